@@ -0,0 +1,503 @@
+// Benchmarks for the rope library.
+//
+// Build with `make bench`, which also builds a copy of the rope with the node
+// pool disabled (bench_nopool) so the two can be compared side by side.
+//
+// Usage: bench [seed] [--json]. With --json every result is printed as a JSON
+// object on a line of its own, for scripts tracking regressions.
+
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rope.h"
+
+#define MIN(x,y) ((x) > (y) ? (y) : (x))
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int json = 0;
+
+static void report_units(const char *name, size_t ops, const char *unit, double secs) {
+  if (json) {
+    printf("{\"name\": \"%s\", \"count\": %zu, \"unit\": \"%s\", \"secs\": %.6f, "
+        "\"per_sec\": %.1f}\n", name, ops, unit, secs, ops / secs);
+  } else {
+    printf("%-24s %10zu %-3s %8.3f s %12.0f %s/s\n", name, ops, unit, secs, ops / secs, unit);
+  }
+}
+
+static void report(const char *name, size_t ops, double secs) {
+  report_units(name, ops, "ops", secs);
+}
+
+// Extra detail under a result. Left out of --json output.
+static void note(const char *fmt, ...) {
+  if (json) return;
+  va_list ap;
+  va_start(ap, fmt);
+  printf("  ");
+  vprintf(fmt, ap);
+  printf("\n");
+  va_end(ap);
+}
+
+// An ascii document of num_bytes with 80 column lines.
+static uint8_t *make_text(size_t num_bytes) {
+  uint8_t *buf = (uint8_t *)malloc(num_bytes);
+  for (size_t i = 0; i < num_bytes; i++) {
+    buf[i] = i % 80 == 79 ? '\n' : 'a' + i % 26;
+  }
+  return buf;
+}
+
+// Every rope gets the seed from the command line, so node heights (and so the
+// layout of each rope) are the same from run to run.
+static uint64_t seed = 1234;
+
+static rope *new_rope() {
+  rope *r = rope_new();
+  rope_set_seed(r, seed);
+  return r;
+}
+
+// Type characters one at a time at a cursor which mostly moves forward.
+static void bench_typing(size_t ops) {
+  rope *r = new_rope();
+  size_t cursor = 0;
+
+  double start = now();
+  for (size_t i = 0; i < ops; i++) {
+    rope_insert(r, cursor, (const uint8_t *)(i % 60 == 59 ? "\n" : "x"));
+    cursor++;
+    if (random() % 100 == 0) cursor = random() % (rope_char_count(r) + 1);
+  }
+  report("typing", ops, now() - start);
+  rope_free(r);
+}
+
+// Replay typing into the middle of a large document: a burst of characters
+// (with the odd backspace) at a cursor, then a jump somewhere else. Every
+// keystroke should cost about the same no matter how big the document is.
+static void bench_typing_large(size_t num_bytes, size_t ops) {
+  uint8_t *buf = make_text(num_bytes);
+  rope *r = rope_new_from_buffer(buf, num_bytes);
+  rope_set_seed(r, seed);
+  free(buf);
+
+  size_t cursor = random() % (rope_char_count(r) + 1);
+  double start = now();
+  for (size_t i = 0; i < ops; i++) {
+    if (random() % 10 == 0 && cursor > 0) {
+      rope_del(r, --cursor, 1);
+    } else {
+      rope_insert(r, cursor++, (const uint8_t *)(i % 60 == 59 ? "\n" : "x"));
+    }
+    if (random() % 1000 == 0) cursor = random() % (rope_char_count(r) + 1);
+  }
+  char label[64];
+  snprintf(label, sizeof(label), "typing (%zu MB)", num_bytes >> 20);
+  report(label, ops, now() - start);
+  rope_free(r);
+}
+
+// Insert short strings at random positions.
+static void bench_random_insert(size_t ops) {
+  rope *r = new_rope();
+
+  double start = now();
+  for (size_t i = 0; i < ops; i++) {
+    size_t pos = random() % (rope_char_count(r) + 1);
+    rope_insert(r, pos, (const uint8_t *)"hello there, ");
+  }
+  report("random insert", ops, now() - start);
+  rope_free(r);
+}
+
+// Fragment a rope with random inserts and deletes, then compact it in small steps the way an
+// editor would while idle.
+static void bench_compact(size_t ops) {
+  rope *r = new_rope();
+  for (size_t i = 0; i < ops; i++) {
+    size_t pos = random() % (rope_char_count(r) + 1);
+    rope_insert(r, pos, (const uint8_t *)"hello there, ");
+    if (i % 2) rope_del(r, random() % rope_char_count(r), 10);
+  }
+
+  double fill = rope_fill_ratio(r);
+  size_t steps = 1;
+  double start = now();
+  while (!rope_compact(r, 1000)) steps++;
+  double secs = now() - start;
+  report("compact (steps)", steps, secs);
+  note("1000 nodes a step, fill ratio %.2f -> %.2f, %.1f us per step", fill, rope_fill_ratio(r),
+      secs / steps * 1e6);
+  rope_free(r);
+}
+
+// Snapshot a big document between bursts of typing, as a background save or
+// search would. Each burst lands in a large node the snapshot shares, so it
+// has to be copied first.
+static void bench_snapshot(size_t num_bytes, size_t ops) {
+  uint8_t *buf = make_text(num_bytes);
+  rope *r = rope_new_from_buffer(buf, num_bytes);
+  rope_set_seed(r, seed);
+  free(buf);
+
+  double snap_secs = 0;
+  double start = now();
+  for (size_t i = 0; i < ops; i++) {
+    double snap_start = now();
+    rope_view *v = rope_snapshot(r);
+    snap_secs += now() - snap_start;
+    size_t pos = random() % (rope_char_count(r) + 1);
+    for (int j = 0; j < 10; j++) rope_insert(r, pos + j, (const uint8_t *)"x");
+    rope_view_free(v);
+  }
+  char label[64];
+  snprintf(label, sizeof(label), "snapshot + type (%zu MB)", num_bytes >> 20);
+  report(label, ops, now() - start);
+  note("%.0f us per snapshot", snap_secs / ops * 1e6);
+  rope_free(r);
+}
+
+#if ROPE_COLUMNS
+// Scroll around a single very long line with tabs in it, mapping the cursor to
+// a screen column and back like an editor does every frame.
+static void bench_columns(size_t num_bytes, size_t ops) {
+  uint8_t *buf = make_text(num_bytes);
+  for (size_t i = 0; i < num_bytes; i++) {
+    if (buf[i] == '\n') buf[i] = i % 160 == 79 ? '\t' : ' ';
+  }
+  rope *r = rope_new_from_buffer(buf, num_bytes);
+  rope_set_seed(r, seed);
+  free(buf);
+
+  size_t num_chars = rope_char_count(r);
+  double start = now();
+  for (size_t i = 0; i < ops; i++) {
+    size_t col = rope_char_to_column(r, random() % (num_chars + 1));
+    rope_column_to_char(r, 0, col + 1);
+  }
+  report("columns (16 MB line)", ops, now() - start);
+  rope_free(r);
+}
+#endif
+
+// Delete random ranges and type them back in, so nodes are constantly being
+// freed and reallocated.
+static void bench_delete_retype(size_t ops) {
+  rope *r = new_rope();
+  for (int i = 0; i < 20000; i++) {
+    rope_append(r, (const uint8_t *)"The quick brown fox jumps over the lazy dog.\n");
+  }
+
+  double start = now();
+  for (size_t i = 0; i < ops; i++) {
+    size_t len = 1 + random() % 400;
+    size_t pos = random() % (rope_char_count(r) - len);
+    rope_del(r, pos, len);
+    for (size_t j = 0; j < len; j += 40) {
+      rope_insert(r, pos + j, (const uint8_t *)"Pack my box with five dozen liquor jugs.");
+    }
+    rope_del(r, pos + len, (len + 39) / 40 * 40 - len);
+  }
+  report("delete + retype", ops, now() - start);
+  rope_free(r);
+}
+
+// Replace every "fox" in a document with "wolf", once with a rope_del and
+// rope_insert per site and once as a single rope_apply_edits batch.
+static void bench_replace_all(size_t num_sites) {
+  const char *line = "The quick brown fox jumps over the lazy dog.\n";
+  const size_t line_len = strlen(line), fox = strstr(line, "fox") - line;
+  size_t num_bytes = num_sites * line_len;
+  uint8_t *buf = (uint8_t *)malloc(num_bytes);
+  for (size_t i = 0; i < num_sites; i++) {
+    memcpy(&buf[i * line_len], line, line_len);
+  }
+
+  rope *r = rope_new_from_buffer(buf, num_bytes);
+  rope_set_seed(r, seed);
+  double start = now();
+  for (size_t i = 0; i < num_sites; i++) {
+    // Each earlier site has grown by a character.
+    size_t pos = i * (line_len + 1) + fox;
+    rope_del(r, pos, 3);
+    rope_insert(r, pos, (const uint8_t *)"wolf");
+  }
+  report("replace all (one by one)", num_sites, now() - start);
+  rope_free(r);
+
+  rope_edit *edits = (rope_edit *)malloc(num_sites * sizeof(rope_edit));
+  for (size_t i = 0; i < num_sites; i++) {
+    edits[i].pos = i * line_len + fox;
+    edits[i].num_deleted = 3;
+    edits[i].str = (const uint8_t *)"wolf";
+    edits[i].num_bytes = 4;
+  }
+  r = rope_new_from_buffer(buf, num_bytes);
+  rope_set_seed(r, seed);
+  start = now();
+  rope_apply_edits(r, edits, num_sites);
+  report("replace all (batched)", num_sites, now() - start);
+  rope_free(r);
+
+  free(edits);
+  free(buf);
+}
+
+// Cut a few megabytes out of a large document and paste them back in somewhere else, using
+// rope_split_at and rope_concat.
+static void bench_cut_paste(size_t num_bytes, size_t ops) {
+  uint8_t *buf = make_text(num_bytes);
+  rope *r = rope_new_from_buffer(buf, num_bytes);
+  rope_set_seed(r, seed);
+  free(buf);
+
+  double start = now();
+  for (size_t i = 0; i < ops; i++) {
+    size_t len = (1 << 20) + random() % (8 << 20);
+    size_t pos = random() % (rope_char_count(r) - len);
+    rope *cut = rope_split_at(r, pos);
+    rope_concat(r, rope_split_at(cut, len));
+
+    rope *rest = rope_split_at(r, random() % (rope_char_count(r) + 1));
+    rope_concat(r, cut);
+    rope_concat(r, rest);
+  }
+  report("cut + paste (MBs)", ops, now() - start);
+  rope_free(r);
+}
+
+// Load a large document, either by appending it a chunk at a time (which is
+// what the editor used to do) or with rope_new_from_buffer.
+static void bench_load(size_t num_bytes) {
+  uint8_t *buf = make_text(num_bytes);
+
+  double start = now();
+  rope *r = new_rope();
+  const size_t chunk = 4096;
+  for (size_t i = 0; i < num_bytes; i += chunk) {
+    rope_append_n(r, &buf[i], MIN(chunk, num_bytes - i));
+  }
+  report_units("load (append)", num_bytes >> 20, "MB", now() - start);
+  rope_free(r);
+
+  start = now();
+  r = rope_new_from_buffer(buf, num_bytes);
+  report_units("load (from buffer)", num_bytes >> 20, "MB", now() - start);
+  size_t num_nodes = 0;
+  ROPE_FOREACH(r, n) num_nodes++;
+  note("%zu nodes, %.0f bytes of text per node", num_nodes, (double)num_bytes / num_nodes);
+  rope_free(r);
+
+  // The nodes point into buf, so only the skip list is allocated.
+  start = now();
+  r = rope_new_from_mapped(buf, num_bytes);
+  report_units("load (borrowed)", num_bytes >> 20, "MB", now() - start);
+  rope_free(r);
+  free(buf);
+}
+
+// The operations bench_latency times one at a time.
+enum { OP_INSERT, OP_DELETE, OP_TYPE, OP_APPEND, OP_PASTE, OP_COPY, OP_CSTR, NUM_OPS };
+static const char *op_names[NUM_OPS] = {
+  "insert", "delete", "type", "append", "paste 64KB", "rope_copy", "rope_create_cstr"
+};
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Time each operation on its own in a document of num_bytes, and report
+// throughput along with the median and 99th percentile latency. Each kind of
+// operation runs for up to max_ops operations or a quarter of a second,
+// whichever comes first. (The slow ones on a big document only manage a few
+// hundred.)
+static void bench_latency(size_t num_bytes, size_t max_ops) {
+  uint8_t *buf = make_text(num_bytes);
+  const size_t paste_bytes = 64 << 10;
+  uint8_t *paste = make_text(paste_bytes + 1);
+  paste[paste_bytes] = '\0';
+  double *times = (double *)malloc(max_ops * sizeof(double));
+
+  for (int op = 0; op < NUM_OPS; op++) {
+    rope *r = rope_new_from_buffer(buf, num_bytes);
+    rope_set_seed(r, seed);
+    size_t cursor = rope_char_count(r) / 2;
+
+    size_t n = 0;
+    double total = 0;
+    while (n < max_ops && total < 0.25) {
+      size_t pos = random() % (rope_char_count(r) + 1);
+      double start = now();
+      switch (op) {
+        case OP_INSERT: rope_insert(r, pos, (const uint8_t *)"hello there, "); break;
+        case OP_DELETE: rope_del(r, pos, 13); break;
+        case OP_TYPE: rope_insert(r, cursor++, (const uint8_t *)"x"); break;
+        case OP_APPEND:
+          rope_append(r, (const uint8_t *)"The quick brown fox jumps over the lazy dog.\n");
+          break;
+        case OP_PASTE: rope_insert(r, pos, paste); break;
+        case OP_COPY: rope_free(rope_copy(r)); break;
+        case OP_CSTR: r->free(rope_create_cstr(r)); break;
+      }
+      times[n] = now() - start;
+      total += times[n++];
+
+      // Put deletes and pastes back (untimed), so the document stays the same size.
+      if (op == OP_DELETE) rope_insert(r, pos, (const uint8_t *)"hello there, ");
+      if (op == OP_PASTE) rope_del(r, pos, paste_bytes);
+    }
+    rope_free(r);
+
+    qsort(times, n, sizeof(double), compare_doubles);
+    double p50 = times[n / 2], p99 = times[n * 99 / 100];
+    char size[16];
+    if (num_bytes >= 1 << 20) snprintf(size, sizeof(size), "%zuMB", num_bytes >> 20);
+    else snprintf(size, sizeof(size), "%zuKB", num_bytes >> 10);
+    if (json) {
+      printf("{\"name\": \"latency %s\", \"doc_bytes\": %zu, \"count\": %zu, \"unit\": \"ops\", "
+          "\"secs\": %.6f, \"per_sec\": %.1f, \"p50_ns\": %.0f, \"p99_ns\": %.0f}\n",
+          op_names[op], num_bytes, n, total, n / total, p50 * 1e9, p99 * 1e9);
+    } else {
+      printf("%-17s %6s %10zu ops %12.0f ops/s  p50 %10.0f ns  p99 %10.0f ns\n",
+          op_names[op], size, n, n / total, p50 * 1e9, p99 * 1e9);
+    }
+  }
+
+  free(times);
+  free(paste);
+  free(buf);
+}
+
+// The byte at a time loops rope_insert used to run over every string: one
+// pass to validate it and find its length, and another to count characters.
+// Kept here so the SIMD kernels have something to be compared against.
+static size_t legacy_codepoint_size(uint8_t byte) {
+  if (byte == 0) { return SIZE_MAX; }
+  else if (byte <= 0x7f) { return 1; }
+  else if (byte <= 0xbf) { return SIZE_MAX; }
+  else if (byte <= 0xdf) { return 2; }
+  else if (byte <= 0xef) { return 3; }
+  else if (byte <= 0xf7) { return 4; }
+  else if (byte <= 0xfb) { return 5; }
+  else if (byte <= 0xfd) { return 6; }
+  else { return SIZE_MAX; }
+}
+
+static size_t legacy_scan(const uint8_t *str) {
+  const uint8_t *p = str;
+  while (*p != '\0') {
+    size_t size = legacy_codepoint_size(*p);
+    if (size == SIZE_MAX) return SIZE_MAX;
+    p++; size--;
+    while (size > 0) {
+      if ((*p & 0xc0) != 0x80) return SIZE_MAX;
+      p++; size--;
+    }
+  }
+
+  size_t chars = 0;
+  for (p = str; *p; chars++) {
+    p += legacy_codepoint_size(*p);
+  }
+  return chars;
+}
+
+// Fill buf with copies of the given strings, picked at random.
+static void fill_utf8(uint8_t *buf, size_t num_bytes, const char **pieces, int num_pieces) {
+  size_t i = 0;
+  for (;;) {
+    const char *piece = pieces[random() % num_pieces];
+    size_t len = strlen(piece);
+    if (i + len > num_bytes) break;
+    memcpy(&buf[i], piece, len);
+    i += len;
+  }
+  memset(&buf[i], ' ', num_bytes - i);
+  buf[num_bytes] = '\0';
+}
+
+static void bench_utf8_input(const char *name, const char **pieces, int num_pieces) {
+  const size_t num_bytes = 16 << 20;
+  const int passes = 8;
+  uint8_t *buf = (uint8_t *)malloc(num_bytes + 1);
+  fill_utf8(buf, num_bytes, pieces, num_pieces);
+
+  const struct { const char *name; ROPE_KERNEL kernel; } kernels[] = {
+    {"scalar", ROPE_KERNEL_SCALAR}, {"sse2", ROPE_KERNEL_SSE2}, {"avx2", ROPE_KERNEL_AVX2},
+  };
+  char label[64];
+
+  double start = now();
+  size_t expected = 0;
+  for (int i = 0; i < passes; i++) expected = legacy_scan(buf);
+  snprintf(label, sizeof(label), "utf8 %s legacy", name);
+  report_units(label, passes * (num_bytes >> 20), "MB", now() - start);
+
+  for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if (_rope_set_kernel(kernels[k].kernel) != kernels[k].kernel) continue;
+    start = now();
+    for (int i = 0; i < passes; i++) {
+      if (_rope_scan_utf8(buf, num_bytes, NULL) != expected) {
+        fprintf(stderr, "%s kernel disagrees with the legacy scan\n", kernels[k].name);
+        exit(1);
+      }
+    }
+    snprintf(label, sizeof(label), "utf8 %s %s", name, kernels[k].name);
+    report_units(label, passes * (num_bytes >> 20), "MB", now() - start);
+  }
+  _rope_set_kernel(ROPE_KERNEL_AUTO);
+  free(buf);
+}
+
+static void bench_utf8() {
+  const char *ascii[] = {"the ", "quick ", "brown ", "fox\n"};
+  const char *mixed[] = {"hello ", "\xd0\xbf\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 ",
+    "\xe4\xbd\xa0\xe5\xa5\xbd ", "caf\xc3\xa9\n"};
+  const char *emoji[] = {"\xf0\x9f\x98\x80", "\xf0\x9f\x8e\x89", "\xf0\x9f\x91\x8d ", "ok\n"};
+  bench_utf8_input("ascii", ascii, 4);
+  bench_utf8_input("mixed", mixed, 4);
+  bench_utf8_input("emoji", emoji, 4);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0) json = 1;
+    else seed = strtoull(argv[i], NULL, 10);
+  }
+  srandom(seed);
+  const char *config = json
+      ? "{\"ROPE_POOL\": %d, \"ROPE_FINGER\": %d, \"ROPE_NODE_STR_SIZE\": %d, "
+        "\"ROPE_LARGE_NODE_STR_SIZE\": %d, \"seed\": %llu}\n"
+      : "ROPE_POOL=%d ROPE_FINGER=%d ROPE_NODE_STR_SIZE=%d ROPE_LARGE_NODE_STR_SIZE=%d seed=%llu\n";
+  printf(config, ROPE_POOL, ROPE_FINGER, ROPE_NODE_STR_SIZE, ROPE_LARGE_NODE_STR_SIZE,
+      (unsigned long long)seed);
+
+  bench_typing(2000000);
+  bench_typing_large(100 << 20, 2000000);
+  bench_random_insert(1000000);
+  bench_delete_retype(200000);
+  bench_compact(1000000);
+  bench_replace_all(100000);
+  bench_cut_paste(100 << 20, 100000);
+  bench_snapshot(100 << 20, 200);
+#if ROPE_COLUMNS
+  bench_columns(16 << 20, 1000000);
+#endif
+  bench_load(256 << 20);
+  for (size_t size = 64 << 10; size <= 64 << 20; size <<= 4) bench_latency(size, 200000);
+  bench_utf8();
+  return 0;
+}
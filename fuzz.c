@@ -0,0 +1,443 @@
+// Differential fuzzer for the rope library.
+//
+// Replays a long random sequence of edits against a rope and against a flat
+// buffer holding the same text, and checks the two agree after every step.
+// The rope side of each step is timed by class of operation, so a change
+// meant to speed one of them up can show that it did (and didn't slow down the
+// others).
+//
+// Build and run with `make fuzz`. Usage: fuzz [seed] [steps]. Building with
+// -DDEBUG makes the rope check its own structure as well (and set
+// ROPE_CHECK_EVERY=1 in the environment to check all of it after every edit),
+// though the timings are then mostly the checks.
+
+#define _DEFAULT_SOURCE
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "rope.h"
+
+// Documents are kept about this size, so comparing the whole thing after every
+// step stays cheap.
+#define MAX_BYTES (16 << 10)
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void fail(const char *what, size_t step) {
+  fprintf(stderr, "step %zu: %s\n", step, what);
+  abort();
+}
+
+#define CHECK(cond) do { if (!(cond)) fail(#cond, step); } while (0)
+
+// The classes of operation which are timed separately.
+enum {
+  OP_INSERT, OP_APPEND, OP_DELETE, OP_BYTES, OP_WCHAR, OP_EDITS, OP_COPY, OP_SPLIT,
+  OP_RELOAD, OP_SNAPSHOT, OP_COMPACT, OP_QUERY, NUM_OPS
+};
+static const char *op_names[NUM_OPS] = {
+  "insert", "append", "delete", "byte insert/del", "wchar insert/del", "apply_edits",
+  "rope_copy", "split + concat", "reload", "snapshot", "compact", "queries"
+};
+static double op_secs[NUM_OPS];
+static size_t op_count[NUM_OPS];
+static double op_start;
+
+static void start_op() {
+  op_start = now();
+}
+
+static void end_op(int op) {
+  op_secs[op] += now() - op_start;
+  op_count[op]++;
+}
+
+// The reference copy of the rope's text.
+static uint8_t ref[MAX_BYTES * 4];
+static size_t ref_bytes;
+
+static size_t utf8_size(uint8_t byte) {
+  return byte < 0x80 ? 1 : byte < 0xe0 ? 2 : byte < 0xf0 ? 3 : 4;
+}
+
+// The byte offset of character pos in ref.
+static size_t ref_char_to_byte(size_t pos) {
+  size_t b = 0;
+  while (pos--) b += utf8_size(ref[b]);
+  return b;
+}
+
+static size_t ref_chars(size_t from_byte, size_t to_byte) {
+  size_t n = 0;
+  for (size_t b = from_byte; b < to_byte; b++) n += (ref[b] & 0xc0) != 0x80;
+  return n;
+}
+
+#if ROPE_WCHAR
+// Characters outside the BMP take 2 wchars.
+static size_t ref_wchars(size_t from_byte, size_t to_byte) {
+  size_t n = 0;
+  for (size_t b = from_byte; b < to_byte; b++) {
+    if ((ref[b] & 0xc0) != 0x80) n += ref[b] >= 0xf0 ? 2 : 1;
+  }
+  return n;
+}
+#endif
+
+#if ROPE_COLUMNS
+// The display column after the character at ref[b], if it starts at col.
+static size_t ref_column_after(size_t b, size_t col) {
+  if (ref[b] == '\t') return (col / ROPE_TAB_STOP + 1) * ROPE_TAB_STOP;
+  if (ref[b] == '\n') return 0;
+  size_t size = utf8_size(ref[b]);
+  int32_t c = size == 1 ? ref[b] : ref[b] & (0x7f >> size);
+  for (size_t i = 1; i < size; i++) c = (c << 6) | (ref[b + i] & 0x3f);
+  return col + rope_codepoint_width(c);
+}
+#endif
+
+static void ref_insert(size_t at, const uint8_t *str, size_t num_bytes) {
+  memmove(&ref[at + num_bytes], &ref[at], ref_bytes - at);
+  memcpy(&ref[at], str, num_bytes);
+  ref_bytes += num_bytes;
+}
+
+static void ref_del(size_t from, size_t to) {
+  memmove(&ref[from], &ref[to], ref_bytes - to);
+  ref_bytes -= to - from;
+}
+
+// Fill str with a few random pieces of text. Returns its length in bytes.
+static size_t random_text(uint8_t *str, size_t max_pieces) {
+  static const char *pieces[] = {
+    "a", "b", "\n", "xyz", "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "hello world\n", "\t",
+    "\xe4\xb8\xad", "e\xcc\x81"
+  };
+  size_t n = 0, count = 1 + random() % max_pieces;
+  for (size_t i = 0; i < count; i++) {
+    const char *p = pieces[random() % (sizeof(pieces) / sizeof(pieces[0]))];
+    size_t len = strlen(p);
+    memcpy(&str[n], p, len);
+    n += len;
+  }
+  str[n] = '\0';
+  return n;
+}
+
+// A random position, mostly near the last one, like an editor's cursor.
+static size_t last_pos;
+static size_t random_pos(size_t num_chars) {
+  size_t pos = random() % 2 ? last_pos + random() % 3 : random() % (num_chars + 1);
+  last_pos = pos < num_chars ? pos : num_chars;
+  return last_pos;
+}
+
+// Compare everything about r against the reference.
+static void check_rope(rope *r, size_t step) {
+  CHECK(rope_byte_count(r) == ref_bytes);
+  CHECK(rope_char_count(r) == ref_chars(0, ref_bytes));
+
+  rope_cursor c;
+  rope_cursor_at_char(r, &c, 0);
+  size_t offset = 0;
+  do {
+    size_t n;
+    const uint8_t *chunk = rope_cursor_chunk(&c, &n);
+    CHECK(offset + n <= ref_bytes && memcmp(chunk, &ref[offset], n) == 0);
+    offset += n;
+  } while (rope_cursor_next_chunk(&c));
+  CHECK(offset == ref_bytes);
+
+  size_t lines = 0;
+  for (size_t b = 0; b < ref_bytes; b++) lines += ref[b] == '\n';
+  CHECK(rope_line_count(r) == lines + 1);
+#if ROPE_WCHAR
+  CHECK(rope_wchar_count(r) == ref_wchars(0, ref_bytes));
+#endif
+}
+
+// Spot check the lookups at a few random places.
+static void check_queries(rope *r, size_t step) {
+  static uint8_t out[MAX_BYTES * 4];
+  size_t num_chars = rope_char_count(r);
+  size_t pos = random() % (num_chars + 1), n = random() % 200;
+  size_t from = ref_char_to_byte(pos);
+  size_t to = ref_char_to_byte(pos + n < num_chars ? pos + n : num_chars);
+
+  start_op();
+  size_t copied = rope_copy_range(r, pos, n, out);
+  size_t byte_pos = rope_char_to_byte(r, pos);
+  size_t char_pos = rope_byte_to_char(r, from);
+  size_t line = rope_char_to_line(r, pos);
+  size_t line_start = rope_line_to_char(r, line);
+#if ROPE_COLUMNS
+  size_t column = rope_char_to_column(r, pos);
+  size_t column_pos = rope_column_to_char(r, line, column);
+#endif
+  end_op(OP_QUERY);
+
+  CHECK(copied == to - from && memcmp(out, &ref[from], copied) == 0);
+  CHECK(byte_pos == from && char_pos == pos);
+  size_t lines = 0, start = 0;
+  for (size_t b = 0; b < from; b++) {
+    if (ref[b] == '\n') {
+      lines++;
+      start = b + 1;
+    }
+  }
+  CHECK(line == lines && line_start == ref_chars(0, start));
+
+#if ROPE_COLUMNS
+  size_t col = 0;
+  for (size_t b = start; b < from; b += utf8_size(ref[b])) col = ref_column_after(b, col);
+  CHECK(column == col);
+  // Mapping the column back skips any zero width characters after pos.
+  size_t b = from;
+  while (b < ref_bytes && ref[b] != '\n' && ref_column_after(b, col) == col) b += utf8_size(ref[b]);
+  CHECK(column_pos == ref_chars(0, b));
+#endif
+}
+
+// Snapshots taken along the way, and the text each should still hold.
+#define NUM_VIEWS 4
+static rope_view *views[NUM_VIEWS];
+static uint8_t *view_text[NUM_VIEWS];
+static size_t view_bytes[NUM_VIEWS];
+
+static void check_view(int i, size_t step) {
+  size_t num_slices, offset = 0;
+  const rope_slice *slices = rope_view_slices(views[i], &num_slices);
+  for (size_t s = 0; s < num_slices; s++) {
+    CHECK(offset + slices[s].num_bytes <= view_bytes[i]);
+    CHECK(memcmp(slices[s].data, &view_text[i][offset], slices[s].num_bytes) == 0);
+    offset += slices[s].num_bytes;
+  }
+  CHECK(offset == view_bytes[i] && rope_view_byte_count(views[i]) == view_bytes[i]);
+}
+
+static void free_view(int i, size_t step) {
+  if (views[i] == NULL) return;
+  check_view(i, step);
+  rope_view_free(views[i]);
+  free(view_text[i]);
+  views[i] = NULL;
+}
+
+// Read only copies of the reference handed to rope_new_from_mapped. Any write
+// through the rope faults. They're kept until the end, since copies and views
+// of the rope might still point into them.
+static void **mappings;
+static size_t *mapping_sizes, num_mappings;
+
+static rope *reload_mapped() {
+  size_t size = ref_bytes ? ref_bytes : 1;
+  uint8_t *m = (uint8_t *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (m == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  memcpy(m, ref, ref_bytes);
+  mprotect(m, size, PROT_READ);
+  mappings = (void **)realloc(mappings, (num_mappings + 1) * sizeof(void *));
+  mapping_sizes = (size_t *)realloc(mapping_sizes, (num_mappings + 1) * sizeof(size_t));
+  mappings[num_mappings] = m;
+  mapping_sizes[num_mappings++] = size;
+  return rope_new_from_mapped(m, ref_bytes);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long seed = argc > 1 ? strtoul(argv[1], NULL, 10) : 1;
+  size_t steps = argc > 2 ? strtoul(argv[2], NULL, 10) : 100000;
+  srandom(seed);
+  printf("seed %lu, %zu steps, ROPE_WCHAR=%d ROPE_POOL=%d ROPE_FINGER=%d\n",
+      seed, steps, ROPE_WCHAR, ROPE_POOL, ROPE_FINGER);
+
+  rope *r = rope_new();
+  rope_set_seed(r, seed);
+  uint8_t str[2048];
+
+  for (size_t step = 0; step < steps; step++) {
+    size_t num_chars = rope_char_count(r);
+    // Lean towards deleting once the document is big enough.
+    bool big = ref_bytes > MAX_BYTES;
+    int choice = random() % 100;
+    // Make sure there's room for the biggest insert.
+    if (ref_bytes > MAX_BYTES * 3) choice = 50;
+
+    if (choice < (big ? 10 : 30)) {
+      size_t pos = random_pos(num_chars);
+      size_t n = random_text(str, random() % 8 == 0 ? 100 : 4);
+      size_t at = ref_char_to_byte(pos);
+      ref_insert(at, str, n);
+      start_op();
+      CHECK(rope_insert(r, pos, str) == ROPE_OK);
+      end_op(OP_INSERT);
+    } else if (choice < (big ? 15 : 40)) {
+      // Length delimited, with the odd '\0' in the middle.
+      size_t n = random_text(str, 8);
+      for (size_t i = 0; i < n; i++) if (str[i] == 'x') str[i] = '\0';
+      bool append = random() % 2;
+      size_t pos = append ? num_chars : random_pos(num_chars);
+      ref_insert(ref_char_to_byte(pos), str, n);
+      start_op();
+      CHECK((append ? rope_append_n(r, str, n) : rope_insert_n(r, pos, str, n)) == ROPE_OK);
+      end_op(OP_APPEND);
+    } else if (choice < 60) {
+      size_t pos = random_pos(num_chars);
+      size_t n = random() % (random() % 10 == 0 ? 500 : 5);
+      if (pos + n > num_chars) n = num_chars - pos;
+      ref_del(ref_char_to_byte(pos), ref_char_to_byte(pos + n));
+      start_op();
+      rope_del(r, pos, n);
+      end_op(OP_DELETE);
+    } else if (choice < 66) {
+      // Byte positions may land inside a character, and get rounded down.
+      size_t byte_pos = ref_bytes ? random() % (ref_bytes + 1) : 0, at = byte_pos;
+      while (at > 0 && at < ref_bytes && (ref[at] & 0xc0) == 0x80) at--;
+      if (random() % 2) {
+        size_t n = random_text(str, 2);
+        ref_insert(at, str, n);
+        start_op();
+        CHECK(rope_insert_at_byte(r, byte_pos, str) == ROPE_OK);
+        end_op(OP_BYTES);
+      } else {
+        size_t n = random() % 9, end = byte_pos + n > ref_bytes ? ref_bytes : byte_pos + n;
+        while (end > 0 && end < ref_bytes && (ref[end] & 0xc0) == 0x80) end--;
+        if (end < at) end = at;
+        ref_del(at, end);
+        start_op();
+        rope_del_bytes(r, byte_pos, n);
+        end_op(OP_BYTES);
+      }
+    } else if (choice < 70) {
+#if ROPE_WCHAR
+      size_t pos = random() % (num_chars + 1), at = ref_char_to_byte(pos);
+      size_t wchar_pos = ref_wchars(0, at);
+      if (random() % 2) {
+        size_t n = random_text(str, 2);
+        ref_insert(at, str, n);
+        start_op();
+        size_t char_pos = rope_insert_at_wchar(r, wchar_pos, str);
+        end_op(OP_WCHAR);
+        CHECK(char_pos == pos);
+      } else {
+        size_t n = random() % 4;
+        if (pos + n > num_chars) n = num_chars - pos;
+        size_t end = ref_char_to_byte(pos + n), num_wchars = ref_wchars(at, end);
+        ref_del(at, end);
+        size_t char_len;
+        start_op();
+        size_t char_pos = rope_del_at_wchar(r, wchar_pos, num_wchars, &char_len);
+        end_op(OP_WCHAR);
+        CHECK(char_pos == pos && char_len == n);
+      }
+#endif
+    } else if (choice < 75) {
+      // A sorted batch, like a replace-all. Sometimes with bad utf8, which
+      // should leave the rope alone.
+      rope_edit edits[8];
+      uint8_t strs[8][64];
+      size_t num_edits = random() % 8, pos = 0;
+      for (size_t i = 0; i < num_edits; i++) {
+        pos += random() % 20;
+        if (pos > num_chars) pos = num_chars;
+        edits[i].pos = pos;
+        edits[i].num_deleted = random() % 4;
+        if (pos + edits[i].num_deleted > num_chars) edits[i].num_deleted = num_chars - pos;
+        pos += edits[i].num_deleted;
+        edits[i].num_bytes = random() % 3 ? random_text(strs[i], 2) : 0;
+        edits[i].str = strs[i];
+      }
+      if (num_edits && random() % 10 == 0) {
+        strs[num_edits - 1][0] = 0xff;
+        edits[num_edits - 1].num_bytes = 1;
+        start_op();
+        CHECK(rope_apply_edits(r, edits, num_edits) == ROPE_INVALID_UTF8);
+        end_op(OP_EDITS);
+      } else {
+        for (size_t i = num_edits; i-- > 0;) {
+          size_t at = ref_char_to_byte(edits[i].pos);
+          ref_del(at, ref_char_to_byte(edits[i].pos + edits[i].num_deleted));
+          ref_insert(at, edits[i].str, edits[i].num_bytes);
+        }
+        start_op();
+        CHECK(rope_apply_edits(r, edits, num_edits) == ROPE_OK);
+        end_op(OP_EDITS);
+      }
+    } else if (choice < 79) {
+      start_op();
+      rope *copy = rope_copy(r);
+      rope_free(r);
+      end_op(OP_COPY);
+      r = copy;
+    } else if (choice < 84) {
+      // Split and join back together, sometimes by way of other ropes.
+      size_t pos = random() % (num_chars + 1);
+      start_op();
+      rope *right = rope_split_at(r, pos);
+      end_op(OP_SPLIT);
+      CHECK(rope_char_count(r) == pos && rope_char_count(right) == num_chars - pos);
+      if (random() % 2) {
+        // Join through a fresh rope, with a pool of its own.
+        rope *fresh = rope_new();
+        start_op();
+        rope_concat(fresh, r);
+        end_op(OP_SPLIT);
+        r = fresh;
+      }
+      start_op();
+      rope_concat(r, right);
+      end_op(OP_SPLIT);
+    } else if (choice < 86) {
+      rope *loaded;
+      start_op();
+      loaded = random() % 2 ? rope_new_from_buffer(ref, ref_bytes) : reload_mapped();
+      end_op(OP_RELOAD);
+      CHECK(loaded != NULL);
+      rope_free(r);
+      r = loaded;
+    } else if (choice < 90) {
+      int i = random() % NUM_VIEWS;
+      free_view(i, step);
+      start_op();
+      views[i] = rope_snapshot(r);
+      end_op(OP_SNAPSHOT);
+      view_text[i] = (uint8_t *)malloc(ref_bytes + 1);
+      memcpy(view_text[i], ref, ref_bytes);
+      view_bytes[i] = ref_bytes;
+    } else if (choice < 93) {
+      start_op();
+      rope_compact(r, random() % 40);
+      end_op(OP_COMPACT);
+      CHECK(rope_fill_ratio(r) <= 1.0);
+    } else {
+      check_queries(r, step);
+    }
+
+    check_rope(r, step);
+  }
+
+  for (int i = 0; i < NUM_VIEWS; i++) free_view(i, steps);
+  rope_free(r);
+  for (size_t i = 0; i < num_mappings; i++) munmap(mappings[i], mapping_sizes[i]);
+  free(mappings);
+  free(mapping_sizes);
+
+  printf("%-18s %10s %12s\n", "operation", "count", "ns/op");
+  for (int op = 0; op < NUM_OPS; op++) {
+    if (op_count[op] == 0) continue;
+    printf("%-18s %10zu %12.0f\n", op_names[op], op_count[op], op_secs[op] / op_count[op] * 1e9);
+  }
+  printf("ok\n");
+  return 0;
+}
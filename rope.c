@@ -13,35 +13,87 @@
 #include <assert.h>
 #include "rope.h"
 
+#if ROPE_SIMD && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ROPE_SIMD_X86 1
+#include <immintrin.h>
+#else
+#define ROPE_SIMD_X86 0
+#endif
+
 #define container_of(ptr, type, member) \
     ((type *)((char *)(ptr) - offsetof(type, member)))
 
-// The number of bytes the rope head structure takes up
-static const size_t ROPE_SIZE = sizeof(rope) + sizeof(rope_node) * ROPE_MAX_HEIGHT;
+// The number of bytes the rope head structure takes up. The head's string goes after its nexts.
+static const size_t ROPE_SIZE = sizeof(rope) + sizeof(rope_skip_node) * ROPE_MAX_HEIGHT
+    + ROPE_NODE_STR_SIZE;
 
 #if REF_COUNT
-/* Thread-safe reference counter methods */
+/* Reference counter methods */
 void ref_inc (rope_node *n) {
   n->ref_count++;
 }
 
-static void rope_node_free (rope_node *n) {
-  rope_node *next;
-  for (rope_node *node = n->nexts[0].node; n != NULL; node = next) {
-    next = node->nexts[0].node;
-    free(node);
+int ref_dec (rope_node *n) {
+  return --n->ref_count;
+}
+#endif
+
+#if ROPE_POOL
+static void pool_init(rope *r);
+static void pool_release(rope *r, struct rope_pool_t *p);
+static bool pool_frees_all_nodes(rope *r);
+#endif
+
+static void recycle_init(rope *r) {
+  memset(r->recycled, 0, sizeof(r->recycled));
+  memset(r->num_recycled, 0, sizeof(r->num_recycled));
+}
+
+#if ROPE_CHECK_LEVEL >= 2
+// How many edits go by between full checks. Read from the environment the first time it's
+// needed, so a single run can be made to check everything without a rebuild.
+static size_t check_every() {
+  static size_t every = 0;
+  if (every == 0) {
+    const char *env = getenv("ROPE_CHECK_EVERY");
+    every = env ? (size_t)strtoull(env, NULL, 10) : ROPE_CHECK_EVERY;
+    // 0 means never.
+    if (every == 0) every = SIZE_MAX;
+  }
+  return every;
+}
+#endif
+
+// Called after every edit, with the character position of the edit.
+static inline void check_edit(rope *r, size_t pos) {
+#if ROPE_CHECK_LEVEL >= 1
+  _rope_check_path(r, pos);
+#endif
+#if ROPE_CHECK_LEVEL >= 2
+  if (++r->num_unchecked_edits >= check_every()) {
+    r->num_unchecked_edits = 0;
+    _rope_check(r);
   }
-  free(n->str);
-  free(next);
-  free(n);
+#else
+  (void)r;
+  (void)pos;
+#endif
 }
 
-void ref_dec (rope_node *n) {
-  n->ref_count--;
-  if (n->ref_count <= 0)
-    rope_node_free(n);
+static inline void head_init_str(rope *r) {
+  r->head.str = (uint8_t *)&r->head.nexts[ROPE_MAX_HEIGHT];
+  r->head.capacity = ROPE_NODE_STR_SIZE;
 }
+
+// Forget the finger. Anything which changes the rope other than at the position of the last
+// search has to call this.
+static inline void finger_reset(rope *r) {
+#if ROPE_FINGER
+  r->finger_height = 0;
+#else
+  (void)r;
 #endif
+}
 
 // Create a new rope with no contents
 rope *rope_new2(void *(*alloc)(size_t bytes),
@@ -54,15 +106,33 @@ rope *rope_new2(void *(*alloc)(size_t bytes),
   r->realloc = realloc;
   r->free = free;
 
+#if ROPE_POOL
+  pool_init(r);
+#endif
+  recycle_init(r);
+  finger_reset(r);
+  rope_set_seed(r, ROPE_DEFAULT_SEED);
+  r->compact_pos = 0;
+#if ROPE_CHECK_LEVEL >= 2
+  r->num_unchecked_edits = 0;
+#endif
+
+  head_init_str(r);
   r->head.height = 1;
   r->head.num_bytes = 0;
   r->head.nexts[0].node = NULL;
   r->head.nexts[0].skip_size = 0;
+  r->head.nexts[0].byte_size = 0;
+  r->head.nexts[0].line_size = 0;
 #if REF_COUNT
   r->head.ref_count = 1;
 #endif
 #if ROPE_WCHAR
   r->head.nexts[0].wchar_size = 0;
+#endif
+#if ROPE_COLUMNS
+  r->head.nexts[0].cols.lead = 0;
+  r->head.nexts[0].cols.rest = SIZE_MAX; // No tab or newline.
 #endif
   return r;
 }
@@ -84,11 +154,26 @@ rope *rope_new_with_utf8(const uint8_t *str) {
   }
 }
 
+static rope_node *alloc_node(rope *r, uint8_t height, uint16_t capacity);
+static void free_node(rope *r, rope_node *n);
+
+rope *rope_new_with_utf8_n(const uint8_t *str, size_t num_bytes) {
+  return rope_new_from_buffer(str, num_bytes);
+}
+
 rope *rope_copy(const rope *other) {
   rope *r = (rope *)other->alloc(ROPE_SIZE);
 
   // Just copy most of the head's data. Note this won't copy the nexts list in head.
   *r = *other;
+#if ROPE_POOL
+  // The copy gets slabs of its own.
+  pool_init(r);
+#endif
+  recycle_init(r);
+  finger_reset(r);
+  head_init_str(r);
+  memcpy(r->head.str, other->head.str, other->head.num_bytes);
 
   rope_node *nodes[ROPE_MAX_HEIGHT];
 
@@ -101,12 +186,16 @@ rope *rope_copy(const rope *other) {
   for (rope_node *n = other->head.nexts[0].node; n != NULL; n = n->nexts[0].node) {
     // I wonder if it would be faster if we took this opportunity to rebalance the node list..?
     size_t h = n->height;
-    rope_node *n2 = (rope_node *)r->alloc(sizeof(rope_node) + h * sizeof(rope_skip_node));
+    rope_node *n2 = alloc_node(r, h, n->capacity);
 
     // Would it be faster to just *n2 = *n; ?
     n2->num_bytes = n->num_bytes;
-    n2->height = h;
-    memcpy(n2->str, n->str, n->num_bytes);
+    if (n->capacity) {
+      memcpy(n2->str, n->str, n->num_bytes);
+    } else {
+      // The copy borrows the same text.
+      n2->str = n->str;
+    }
     memcpy(n2->nexts, n->nexts, h * sizeof(rope_skip_node));
 
     for (int i = 0; i < h; i++) {
@@ -121,12 +210,26 @@ rope *rope_copy(const rope *other) {
 // Free the specified rope
 void rope_free(rope *r) {
   assert(r);
-  rope_node *next;
 
-  for (rope_node *n = r->head.nexts[0].node; n != NULL; n = next) {
-    next = n->nexts[0].node;
-    r->free(n);
+#if ROPE_POOL
+  // If nothing else has nodes in our slabs, there's no need to visit the nodes one by one.
+  if (!pool_frees_all_nodes(r)) {
+#endif
+    rope_node *next;
+    for (rope_node *n = r->head.nexts[0].node; n != NULL; n = next) {
+      next = n->nexts[0].node;
+      free_node(r, n);
+    }
+    for (int h = 0; h < ROPE_MAX_HEIGHT; h++) {
+      for (rope_node *n = r->recycled[h]; n != NULL; n = next) {
+        next = n->nexts[0].node;
+        free_node(r, n);
+      }
+    }
+#if ROPE_POOL
   }
+  pool_release(r, r->pool);
+#endif
 
   r->free(r);
 }
@@ -170,60 +273,475 @@ uint8_t *rope_create_cstr(rope *r) {
   return bytes;
 }
 
+size_t rope_line_count(const rope *r) {
+  assert(r);
+  return r->head.nexts[r->head.height - 1].line_size + 1;
+}
+
 #if ROPE_WCHAR
+static size_t node_wchars(rope_node *e, int height);
+
 size_t rope_wchar_count(rope *r) {
   assert(r);
-  return r->head.nexts[r->head.height - 1].wchar_size;
+  return node_wchars(&r->head, r->head.height - 1);
 }
 #endif
 
 #define MIN(x,y) ((x) > (y) ? (y) : (x))
 #define MAX(x,y) ((x) > (y) ? (x) : (y))
 
-#ifdef _WIN32
-inline static long random() {
-  return rand();
+void rope_set_seed(rope *r, uint64_t seed) {
+  // Run the seed through splitmix64, so similar seeds give unrelated sequences and the state is
+  // never 0 (which xorshift can't get out of).
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  seed ^= seed >> 31;
+  r->rng_state = seed ? seed : ROPE_DEFAULT_SEED;
 }
-#endif
 
-static uint8_t random_height() {
-  // This function is horribly inefficient. I'm throwing away heaps of entropy, and
-  // the mod could be replaced by some clever shifting.
-  //
-  // However, random_height barely appears in the profiler output - so its probably
-  // not worth investing the time to optimise.
+// xorshift64*.
+static inline uint64_t random_u64(rope *r) {
+  uint64_t x = r->rng_state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  r->rng_state = x;
+  return x * 0x2545f4914f6cdd1dULL;
+}
 
-  uint8_t height = 1;
+// When ROPE_BIAS is a power of 1/2, every extra level needs ROPE_BIAS_BITS more zero bits at
+// the bottom of a random number. Then the height comes straight out of a count of trailing
+// zeros.
+#if ROPE_BIAS == 50
+#define ROPE_BIAS_BITS 1
+#elif ROPE_BIAS == 25
+#define ROPE_BIAS_BITS 2
+#elif ROPE_BIAS == 12 || ROPE_BIAS == 13
+#define ROPE_BIAS_BITS 3
+#elif ROPE_BIAS == 6
+#define ROPE_BIAS_BITS 4
+#endif
+
+#ifdef ROPE_BIAS_BITS
+static inline int count_trailing_zeros(uint64_t x) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+  while ((x & 1) == 0) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+#endif
 
+static uint8_t random_height(rope *r) {
   // The root node's height is the height of the largest node + 1, so the largest
   // node can only have ROPE_MAX_HEIGHT - 1.
-  while(height < (ROPE_MAX_HEIGHT - 1) && (random() % 100) < ROPE_BIAS) {
+#ifdef ROPE_BIAS_BITS
+  // The top bit caps the count, so this never looks at more than 63 bits. That's plenty: at
+  // the default bias it allows heights up to 32.
+  int height = 1 + count_trailing_zeros(random_u64(r) | (1ULL << 63)) / ROPE_BIAS_BITS;
+  return (uint8_t)MIN(height, ROPE_MAX_HEIGHT - 1);
+#else
+  // Otherwise roll for each level, 16 bits at a time.
+  const uint64_t threshold = (uint64_t)ROPE_BIAS * 65536 / 100;
+  uint8_t height = 1;
+  uint64_t bits = random_u64(r);
+  int bits_left = 64;
+  while (height < (ROPE_MAX_HEIGHT - 1) && (bits & 0xffff) < threshold) {
     height++;
+    bits >>= 16;
+    bits_left -= 16;
+    if (bits_left == 0) {
+      bits = random_u64(r);
+      bits_left = 64;
+    }
   }
-
   return height;
+#endif
+}
+
+// Figure out how many bytes to allocate for a node with the specified height and room for
+// capacity bytes of text. Large nodes keep their text elsewhere, so searches (which only look at
+// the skip pointers) don't have to jump from page to page.
+static size_t node_size(uint8_t height, uint16_t capacity) {
+  size_t size = sizeof(rope_node) + height * sizeof(rope_skip_node)
+      + (capacity == ROPE_NODE_STR_SIZE ? capacity : 0);
+  // Rounded up so nodes packed into a slab stay aligned.
+  return (size + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+}
+
+#if ROPE_POOL
+// A slab is a single allocation holding up to capacity nodes of the same
+// height and size. Nodes are handed out by bumping used, and once freed they're chained
+// through nexts[0].node on the slab's free list.
+typedef struct rope_slab_t {
+  rope_node *free_list;
+  size_t live;
+  size_t used;
+  size_t capacity;
+  size_t stride;
+  void *nodes[];
+} rope_slab;
+
+// All the slabs holding nodes of a single height and size.
+typedef struct {
+  // Sorted by address, so a node can be mapped back to its slab on free.
+  rope_slab **slabs;
+  size_t num_slabs;
+  size_t max_slabs;
+
+  // The number of unused nodes across all the slabs.
+  size_t num_free;
+
+  // A slab which (probably) has room in it. Checked first on alloc.
+  rope_slab *current;
+
+  // We hold on to one empty slab so a node freed and reallocated on a slab
+  // boundary doesn't bounce memory back and forth with the allocator.
+  rope_slab *spare;
+
+  // Every slab before this index is full.
+  size_t scan_from;
+} rope_node_pool;
+
+// Small nodes first, then large nodes. See pool_class.
+#define NUM_POOL_CLASSES (2 * ROPE_MAX_HEIGHT)
+
+typedef struct rope_pool_t {
+  rope_node_pool classes[NUM_POOL_CLASSES];
+
+  // The number of ropes, and merged pools, pointing here.
+  size_t num_refs;
+
+  // The number of large nodes allocated from this pool. Their text has to be freed separately.
+  size_t num_large;
+
+  // Set when rope_concat moves this pool's slabs into another pool. Ropes which still point
+  // here move over the next time they look for their pool.
+  struct rope_pool_t *merged_into;
+} rope_pool;
+
+static void pool_init(rope *r) {
+  r->pool = (rope_pool *)r->alloc(sizeof(rope_pool));
+  memset(r->pool, 0, sizeof(rope_pool));
+  r->pool->num_refs = 1;
+}
+
+// Drop a reference to p. The last reference frees it, along with any slabs it still has.
+static void pool_release(rope *r, rope_pool *p) {
+  while (p != NULL && --p->num_refs == 0) {
+    for (int c = 0; c < NUM_POOL_CLASSES; c++) {
+      rope_node_pool *np = &p->classes[c];
+      for (size_t i = 0; i < np->num_slabs; i++) {
+        r->free(np->slabs[i]);
+      }
+      if (np->slabs) r->free(np->slabs);
+    }
+    rope_pool *parent = p->merged_into;
+    r->free(p);
+    p = parent;
+  }
+}
+
+// Get the pool r's nodes live in, catching up with any merges.
+static rope_pool *pool_get(rope *r) {
+  rope_pool *p = r->pool;
+  if (p->merged_into) {
+    while (p->merged_into) p = p->merged_into;
+    p->num_refs++;
+    pool_release(r, r->pool);
+    r->pool = p;
+  }
+  return p;
+}
+
+// Whether releasing r's pool frees everything r's nodes are holding on to, and nothing else.
+// It doesn't if another rope has nodes in the same slabs, or if there are large nodes (whose
+// text is allocated separately).
+static bool pool_frees_all_nodes(rope *r) {
+  rope_pool *p = pool_get(r);
+  return p->num_refs == 1 && p->num_large == 0;
+}
+
+// Move all of src's slabs into dest, and point src at dest. src is left empty.
+static void pool_merge(rope *r, rope_pool *dest, rope_pool *src) {
+  assert(dest != src && !dest->merged_into && !src->merged_into);
+  for (int c = 0; c < NUM_POOL_CLASSES; c++) {
+    rope_node_pool *d = &dest->classes[c], *s = &src->classes[c];
+    if (d->spare && s->spare) {
+      // dest only needs one empty slab to hold on to. Hand src's back to the allocator.
+      rope_slab *spare = s->spare;
+      size_t i = 0;
+      while (s->slabs[i] != spare) i++;
+      memmove(&s->slabs[i], &s->slabs[i + 1], (s->num_slabs - i - 1) * sizeof(rope_slab *));
+      s->num_slabs--;
+      s->num_free -= spare->capacity;
+      if (s->current == spare) s->current = NULL;
+      s->spare = NULL;
+      r->free(spare);
+    }
+    size_t num_slabs = d->num_slabs + s->num_slabs;
+    if (num_slabs > d->max_slabs) {
+      d->max_slabs = num_slabs;
+      d->slabs = (rope_slab **)r->realloc(d->slabs, num_slabs * sizeof(rope_slab *));
+    }
+
+    // Merge the two sorted lists, from the back so it can be done in place.
+    size_t i = d->num_slabs, j = s->num_slabs, k = num_slabs;
+    while (j > 0) {
+      if (i > 0 && (uint8_t *)d->slabs[i - 1] > (uint8_t *)s->slabs[j - 1]) {
+        d->slabs[--k] = d->slabs[--i];
+      } else {
+        d->slabs[--k] = s->slabs[--j];
+      }
+    }
+    d->num_slabs = num_slabs;
+    d->num_free += s->num_free;
+    d->scan_from = 0;
+    if (d->current == NULL) d->current = s->current;
+    if (d->spare == NULL) d->spare = s->spare;
+
+    if (s->slabs) r->free(s->slabs);
+    memset(s, 0, sizeof(rope_node_pool));
+  }
+  dest->num_large += src->num_large;
+  src->num_large = 0;
+  src->merged_into = dest;
+  dest->num_refs++;
+}
+
+// The slabs for nodes of the given height and capacity.
+static inline rope_node_pool *pool_class(rope *r, uint8_t height, uint16_t capacity) {
+  size_t large = capacity != ROPE_NODE_STR_SIZE;
+  return &pool_get(r)->classes[large * ROPE_MAX_HEIGHT + height - 1];
+}
+
+static inline bool slab_contains(rope_slab *s, rope_node *n) {
+  uint8_t *base = (uint8_t *)s->nodes;
+  return (uint8_t *)n >= base && (uint8_t *)n < base + s->capacity * s->stride;
+}
+
+// Binary search the (address sorted) slab list for the slab holding n.
+static size_t pool_find_slab(rope_node_pool *p, rope_node *n) {
+  size_t lo = 0, hi = p->num_slabs;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ((uint8_t *)p->slabs[mid] <= (uint8_t *)n) lo = mid;
+    else hi = mid;
+  }
+  assert(slab_contains(p->slabs[lo], n));
+  return lo;
 }
 
-// Figure out how many bytes to allocate for a node with the specified height.
-static size_t node_size(uint8_t height) {
-  return sizeof(rope_node) + height * sizeof(rope_skip_node);
+static rope_slab *pool_new_slab(rope *r, rope_node_pool *p, size_t stride) {
+  // Start small and double, up to ROPE_POOL_SLAB_BYTES.
+  size_t capacity = (size_t)4 << MIN(p->num_slabs, 16);
+  size_t max_capacity = MAX(ROPE_POOL_SLAB_BYTES / stride, 1);
+  capacity = MIN(capacity, max_capacity);
+
+  rope_slab *s = (rope_slab *)r->alloc(sizeof(rope_slab) + capacity * stride);
+  s->free_list = NULL;
+  s->live = s->used = 0;
+  s->capacity = capacity;
+  s->stride = stride;
+
+  if (p->num_slabs == p->max_slabs) {
+    p->max_slabs = MAX(p->max_slabs * 2, 4);
+    p->slabs = (rope_slab **)r->realloc(p->slabs, p->max_slabs * sizeof(rope_slab *));
+  }
+
+  // Keep the list sorted. Fresh allocations usually land at the end.
+  size_t i = p->num_slabs;
+  while (i > 0 && (uint8_t *)p->slabs[i - 1] > (uint8_t *)s) i--;
+  memmove(&p->slabs[i + 1], &p->slabs[i], (p->num_slabs - i) * sizeof(rope_slab *));
+  p->slabs[i] = s;
+  p->num_slabs++;
+  p->num_free += capacity;
+  p->scan_from = MIN(p->scan_from, i);
+  return s;
+}
+
+static rope_node *pool_alloc(rope *r, uint8_t height, uint16_t capacity) {
+  rope_node_pool *p = pool_class(r, height, capacity);
+  rope_slab *s = p->current;
+
+  if (s == NULL || s->live == s->capacity) {
+    // Look for any slab with room before growing the pool.
+    s = NULL;
+    size_t i = p->scan_from;
+    for (; p->num_free && i < p->num_slabs; i++) {
+      if (p->slabs[i]->live < p->slabs[i]->capacity) {
+        s = p->slabs[i];
+        break;
+      }
+    }
+    p->scan_from = i;
+    if (s == NULL) s = pool_new_slab(r, p, node_size(height, capacity));
+    p->current = s;
+  }
+  if (s == p->spare) p->spare = NULL;
+
+  rope_node *n;
+  if (s->free_list) {
+    n = s->free_list;
+    s->free_list = n->nexts[0].node;
+  } else {
+    n = (rope_node *)((uint8_t *)s->nodes + s->used * s->stride);
+    s->used++;
+  }
+  s->live++;
+  p->num_free--;
+  return n;
+}
+
+static void pool_free(rope *r, rope_node *n) {
+  rope_node_pool *p = pool_class(r, n->height, n->capacity);
+  size_t i = pool_find_slab(p, n);
+  rope_slab *s = p->slabs[i];
+
+  n->nexts[0].node = s->free_list;
+  s->free_list = n;
+  s->live--;
+  p->num_free++;
+  p->scan_from = MIN(p->scan_from, i);
+
+  if (s->live == 0) {
+    if (p->spare == NULL) {
+      p->spare = s;
+    } else {
+      // Hand the slab back to the allocator.
+      if (p->current == s) p->current = p->spare;
+      memmove(&p->slabs[i], &p->slabs[i + 1], (p->num_slabs - i - 1) * sizeof(rope_slab *));
+      p->num_slabs--;
+      p->num_free -= s->capacity;
+      r->free(s);
+    }
+  } else if (p->current == NULL || p->current->live == p->current->capacity) {
+    p->current = s;
+  }
+}
+#endif
+
+// A large node's text lives in a buffer of its own, which starts with a reference count. The node
+// holds one reference, and each snapshot reading the text holds another. The count is only ever
+// raised by the rope's own thread, but snapshots can drop their references from any thread.
+#define STR_HEADER_SIZE sizeof(size_t)
+
+static inline size_t *large_str_refs(uint8_t *str) {
+  return (size_t *)(str - STR_HEADER_SIZE);
+}
+
+static uint8_t *alloc_large_str(rope *r, size_t capacity) {
+  size_t *refs = (size_t *)r->alloc(STR_HEADER_SIZE + capacity);
+  *refs = 1;
+  return (uint8_t *)refs + STR_HEADER_SIZE;
+}
+
+static void release_large_str(void (*free_fn)(void *), uint8_t *str) {
+  size_t *refs = large_str_refs(str);
+  if (__atomic_sub_fetch(refs, 1, __ATOMIC_ACQ_REL) == 0) free_fn(refs);
 }
 
 // Allocate and return a new node. The new node will be full of junk, except
-// for its height.
-// This function should be replaced at some point with an object pool based version.
-static rope_node *alloc_node(rope *r, uint8_t height) {
-  rope_node *node = (rope_node *)r->alloc(node_size(height));
+// for its height, capacity and str (and reference count). Recently deleted
+// small nodes are reused before asking the allocator.
+//
+// A capacity of 0 makes a borrowed node, which points at text owned by
+// someone else and is never written to. The caller sets its str.
+static rope_node *alloc_node(rope *r, uint8_t height, uint16_t capacity) {
+  bool large = capacity > ROPE_NODE_STR_SIZE;
+  rope_node *node = capacity == ROPE_NODE_STR_SIZE ? r->recycled[height - 1] : NULL;
+  if (node) {
+    r->recycled[height - 1] = node->nexts[0].node;
+    r->num_recycled[height - 1]--;
+  } else {
+#if ROPE_POOL
+    node = pool_alloc(r, height, capacity);
+#else
+    node = (rope_node *)r->alloc(node_size(height, capacity));
+#endif
+  }
   node->height = height;
+  node->capacity = capacity;
+  if (large) {
+    node->str = alloc_large_str(r, capacity);
+#if ROPE_POOL
+    pool_get(r)->num_large++;
+#endif
+  } else if (capacity) {
+    node->str = (uint8_t *)&node->nexts[height];
+  }
+#if REF_COUNT
+  node->ref_count = 1;
+#endif
   return node;
 }
 
+// Copy a borrowed node's text into a buffer of its own, so it can be edited. The node has nowhere
+// to keep its text inline, so this makes it a large node (even if large nodes are turned off).
+#define MATERIALIZED_STR_SIZE MAX(ROPE_LARGE_NODE_STR_SIZE, ROPE_NODE_STR_SIZE + 1)
+static void materialize_node(rope *r, rope_node *n) {
+  assert(n->capacity == 0 && n->num_bytes <= MATERIALIZED_STR_SIZE);
+  uint8_t *str = alloc_large_str(r, MATERIALIZED_STR_SIZE);
+  memcpy(str, n->str, n->num_bytes);
+  n->str = str;
+  n->capacity = MATERIALIZED_STR_SIZE;
+#if ROPE_POOL
+  pool_get(r)->num_large++;
+#endif
+}
+
+// Get n ready to have its text changed. Borrowed text is copied out, and so is the text of a
+// large node which a snapshot is still reading. (Snapshots copy small nodes' text up front.)
+static inline void make_writable(rope *r, rope_node *n) {
+  if (n->capacity == 0) {
+    materialize_node(r, n);
+  } else if (n->capacity > ROPE_NODE_STR_SIZE
+      && __atomic_load_n(large_str_refs(n->str), __ATOMIC_ACQUIRE) > 1) {
+    uint8_t *str = alloc_large_str(r, n->capacity);
+    memcpy(str, n->str, n->num_bytes);
+    release_large_str(r->free, n->str);
+    n->str = str;
+  }
+}
+
+// Give a node which has been unlinked from the rope back to the allocator.
+static void free_node(rope *r, rope_node *n) {
+  if (n->capacity > ROPE_NODE_STR_SIZE) {
+    release_large_str(r->free, n->str);
+#if ROPE_POOL
+    pool_get(r)->num_large--;
+#endif
+  }
+#if ROPE_POOL
+  pool_free(r, n);
+#else
+  r->free(n);
+#endif
+}
+
+// Stash a node which was just unlinked so the next insert can reuse it.
+static void recycle_node(rope *r, rope_node *n) {
+  uint8_t h = n->height - 1;
+  if (n->capacity == ROPE_NODE_STR_SIZE && r->num_recycled[h] < ROPE_RECYCLE_MAX) {
+    n->nexts[0].node = r->recycled[h];
+    r->recycled[h] = n;
+    r->num_recycled[h]++;
+  } else {
+    free_node(r, n);
+  }
+}
+
 // Find out how many bytes the unicode character which starts with the specified byte
 // will occupy in memory.
 // Returns the number of bytes, or SIZE_MAX if the byte is invalid.
 static inline size_t codepoint_size(uint8_t byte) {
-  if (byte == 0) { return SIZE_MAX; } // NULL byte.
-  else if (byte <= 0x7f) { return 1; } // 0x74 = 0111 1111
+  if (byte <= 0x7f) { return 1; } // 0x74 = 0111 1111. Includes '\0'.
   else if (byte <= 0xbf) { return SIZE_MAX; } // 1011 1111. Invalid for a starting byte.
   else if (byte <= 0xdf) { return 2; } // 1101 1111
   else if (byte <= 0xef) { return 3; } // 1110 1111
@@ -233,165 +751,603 @@ static inline size_t codepoint_size(uint8_t byte) {
   else { return SIZE_MAX; }
 }
 
+static int32_t decode_codepoint(const uint8_t *str, size_t size) {
+  if (size == 1) return str[0];
+  int32_t codepoint = str[0] & (0x7f >> size);
+  for (size_t i = 1; i < size; i++) {
+    codepoint = (codepoint << 6) | (str[i] & 0x3f);
+  }
+  return codepoint;
+}
+
 // This little function counts how many bytes a certain number of characters take up.
 static size_t count_bytes_in_utf8(const uint8_t *str, size_t num_chars) {
   const uint8_t *p = str;
+#if ROPE_SIMD_X86 && defined(__SSE2__)
+  // Skip whole 16 byte blocks while we're sure the position we want is past them. Asking for at
+  // least 16 more characters also guarantees there are 16 bytes left to read.
+  const __m128i cont_mask = _mm_set1_epi8((char)0xc0), cont_bits = _mm_set1_epi8((char)0x80);
+  while (num_chars >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    size_t chars = 16 - __builtin_popcount(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, cont_mask), cont_bits)));
+    if (chars >= num_chars) break;
+    num_chars -= chars;
+    p += 16;
+  }
+  // We may have stopped in the middle of a character. (If we moved at all there's at least one
+  // more character to skip, so this can't run off the end.)
+  if (p != str) {
+    while ((*p & 0xc0) == 0x80) p++;
+  }
+#endif
   for (unsigned int i = 0; i < num_chars; i++) {
     p += codepoint_size(*p);
   }
   return p - str;
 }
 
-#if ROPE_WCHAR
-
-#define NEEDS_TWO_WCHARS(x) (((x) & 0xf0) == 0xf0)
+// Edits usually happen at the end of a node, and large nodes are long. Positions closer to the end
+// of a node than this are found by counting back from the end instead.
+#define NEAR_NODE_END 32
 
-static size_t count_wchars_in_utf8(const uint8_t *str, size_t num_chars) {
-  size_t wchars = 0;
-  for (unsigned int i = 0; i < num_chars; i++) {
-    wchars += 1 + NEEDS_TWO_WCHARS(*str);
-    str += codepoint_size(*str);
+// Find the byte offset of character char_pos in a node with num_chars characters.
+static size_t node_char_to_byte(const rope_node *e, size_t char_pos, size_t num_chars) {
+  if (num_chars - char_pos < NEAR_NODE_END) {
+    const uint8_t *p = &e->str[e->num_bytes];
+    for (size_t i = char_pos; i < num_chars; i++) {
+      do p--; while ((*p & 0xc0) == 0x80);
+    }
+    return p - e->str;
   }
-  return wchars;
+  return count_bytes_in_utf8(e->str, char_pos);
 }
 
-static size_t count_utf8_in_wchars(const uint8_t *str, size_t num_wchars) {
-  size_t chars = num_wchars;
-  for (unsigned int i = 0; i < num_wchars; i++) {
-    if (NEEDS_TWO_WCHARS(*str)) {
-      chars--;
-      i++;
-    }
-    str += codepoint_size(*str);
+// Count the characters in the first num_bytes of str. That's every byte which
+// isn't a continuation byte.
+static size_t count_chars_in_utf8(const uint8_t *str, size_t num_bytes) {
+  size_t chars = 0, i = 0;
+#if ROPE_SIMD_X86 && defined(__SSE2__)
+  const __m128i cont_mask = _mm_set1_epi8((char)0xc0), cont_bits = _mm_set1_epi8((char)0x80);
+  for (; i + 16 <= num_bytes; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&str[i]);
+    chars += 16 - __builtin_popcount(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, cont_mask), cont_bits)));
+  }
+#endif
+  for (; i < num_bytes; i++) {
+    chars += (str[i] & 0xc0) != 0x80;
   }
   return chars;
 }
-#endif
 
-// Count the number of characters in a string.
-static size_t strlen_utf8(const uint8_t *str) {
-  const uint8_t *p = str;
-  size_t i = 0;
-  while (*p) {
-    p += codepoint_size(*p);
-    i++;
+// Count the '\n' characters in the first num_bytes of str.
+static size_t count_newlines(const uint8_t *str, size_t num_bytes) {
+  size_t lines = 0;
+  const uint8_t *end = str + num_bytes;
+  while ((str = (const uint8_t *)memchr(str, '\n', end - str)) != NULL) {
+    lines++;
+    str++;
   }
-  return i;
+  return lines;
 }
 
-// Checks if a UTF8 string is ok. Returns the number of bytes in the string if
-// it is ok, otherwise returns -1.
-static ssize_t bytelen_and_check_utf8(const uint8_t *str) {
-  const uint8_t *p = str;
-  while (*p != '\0') {
+// Every insert needs to validate its string and count the characters and newlines in it. The
+// scan_utf8 kernels do all three in one pass. There are SSE2 and AVX2 versions which look at
+// 16 / 32 bytes per step, picked at runtime, and a scalar version which handles everything else
+// (including short strings and the ragged ends of the SIMD loops).
+
+// What a scan found. The kernels add to these, so zero them first.
+typedef struct {
+  size_t num_chars;
+  size_t num_lines;
+} utf8_counts;
+
+// Returns false if the string isn't valid utf8, or a character is cut off by the end of it.
+static bool scan_utf8_scalar(const uint8_t *str, size_t num_bytes, utf8_counts *counts) {
+  const uint8_t *p = str, *end = str + num_bytes;
+  size_t num_chars = 0, num_lines = 0;
+  while (p < end) {
     size_t size = codepoint_size(*p);
-    if (size == SIZE_MAX) return -1;
+    if (size == SIZE_MAX || size > (size_t)(end - p)) return false;
+    num_lines += *p == '\n';
     p++; size--;
     while (size > 0) {
       // Check that any middle bytes are of the form 0x10xx xxxx
       if ((*p & 0xc0) != 0x80)
-        return -1;
+        return false;
       p++; size--;
     }
+    num_chars++;
   }
-
-#ifdef DEBUG
-  size_t num = p - str;
-  assert(num == strlen((char *)str));
-#endif
-
-  return p - str;
+  counts->num_chars += num_chars;
+  counts->num_lines += num_lines;
+  return true;
 }
 
-typedef struct {
-  // This stores the previous node at each height, and the number of characters from the start of
-  // the previous node to the current iterator position.
-  rope_skip_node s[ROPE_MAX_HEIGHT];
-} rope_iter;
+#if ROPE_SIMD_X86
+// Finish off a scan where a SIMD loop stopped at p. Everything before p has been checked, but a
+// character which starts in the last few bytes might run on past p. In that case we back up to
+// its first byte (which the loop has already counted) and let the scalar version redo it.
+static bool scan_utf8_tail(const uint8_t *str, const uint8_t *p, const uint8_t *end,
+    utf8_counts *counts) {
+  const uint8_t *lead = p;
+  while (lead > str && lead > p - 4 && (lead[-1] & 0xc0) == 0x80) lead--;
+  if (lead > str) {
+    lead--;
+    size_t size = codepoint_size(*lead);
+    if (size != SIZE_MAX && size > (size_t)(p - lead)) {
+      counts->num_chars--;
+      p = lead;
+    }
+  }
+  return scan_utf8_scalar(p, end - p, counts);
+}
 
-// Internal function for navigating to a particular character offset in the rope.
-// The function returns the list of nodes which point past the position, as well as
-// offsets of how far into their character lists the specified characters are.
-static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter) {
-  assert(char_pos <= r->num_chars);
+// The SIMD versions check every byte against the bytes before it: a byte must be a continuation
+// byte (10xx xxxx) exactly when one of the 3 bytes before it starts a character long enough to
+// cover it. Blocks containing 5 and 6 byte sequences (or 0xfe / 0xff) are
+// rare enough that we just hand them to the scalar version.
+#define SSE2_PREV(v, prev, n) _mm_or_si128(_mm_slli_si128(v, n), _mm_srli_si128(prev, 16 - n))
+#define SSE2_GE(v, bound) _mm_cmpeq_epi8(_mm_max_epu8(v, bound), v)
+
+static bool scan_utf8_sse2(const uint8_t *str, size_t num_bytes, utf8_counts *counts) {
+  const uint8_t *p = str, *end = str + num_bytes;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i cont_mask = _mm_set1_epi8((char)0xc0), cont_bits = _mm_set1_epi8((char)0x80);
+  const __m128i lead2 = _mm_set1_epi8((char)0xc0);
+  const __m128i lead3 = _mm_set1_epi8((char)0xe0);
+  const __m128i lead4 = _mm_set1_epi8((char)0xf0);
+  const __m128i max_lead = _mm_set1_epi8((char)0xf7);
+
+  __m128i prev = zero;
+  int prev_high = 0;
+  size_t num_chars = 0, num_lines = 0;
+
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int high = _mm_movemask_epi8(v);
+
+    if ((high | (prev_high >> 13)) == 0) {
+      // All ASCII, and nothing carried over from the last block.
+      num_chars += 16;
+    } else {
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(v, max_lead), v)) != 0xffff) break;
 
-  rope_node *e = &r->head;
-  int height = r->head.height - 1;
+      __m128i need = _mm_or_si128(_mm_or_si128(
+          SSE2_GE(SSE2_PREV(v, prev, 1), lead2),
+          SSE2_GE(SSE2_PREV(v, prev, 2), lead3)),
+          SSE2_GE(SSE2_PREV(v, prev, 3), lead4));
+      __m128i is_cont = _mm_cmpeq_epi8(_mm_and_si128(v, cont_mask), cont_bits);
+      if (_mm_movemask_epi8(_mm_xor_si128(need, is_cont))) return false;
 
-  // Offset stores how many characters we still need to skip in the current node.
-  size_t offset = char_pos;
-  size_t skip;
-#if ROPE_WCHAR
-  size_t wchar_pos = 0; // Current wchar pos from the start of the rope.
-#endif
+      num_chars += 16 - __builtin_popcount(_mm_movemask_epi8(is_cont));
+    }
+    num_lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, newline)));
+    prev = v;
+    prev_high = high;
+  }
 
-  while (true) {
-    skip = e->nexts[height].skip_size;
-    if (offset > skip) {
-      // Go right.
-      assert(e == &r->head || e->num_bytes);
+  counts->num_chars += num_chars;
+  counts->num_lines += num_lines;
+  return scan_utf8_tail(str, p, end, counts);
+}
 
-      offset -= skip;
-#if ROPE_WCHAR
-      wchar_pos += e->nexts[height].wchar_size;
-#endif
-      e = e->nexts[height].node;
+// _mm256_alignr_epi8 works within 128 bit lanes, so borrow the low lane of v / high lane of prev.
+#define AVX2_PREV(v, prev, n) \
+  _mm256_alignr_epi8(v, _mm256_permute2x128_si256(prev, v, 0x21), 16 - n)
+#define AVX2_GE(v, bound) _mm256_cmpeq_epi8(_mm256_max_epu8(v, bound), v)
+
+__attribute__((target("avx2")))
+static bool scan_utf8_avx2(const uint8_t *str, size_t num_bytes, utf8_counts *counts) {
+  const uint8_t *p = str, *end = str + num_bytes;
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i cont_mask = _mm256_set1_epi8((char)0xc0), cont_bits = _mm256_set1_epi8((char)0x80);
+  const __m256i lead2 = _mm256_set1_epi8((char)0xc0);
+  const __m256i lead3 = _mm256_set1_epi8((char)0xe0);
+  const __m256i lead4 = _mm256_set1_epi8((char)0xf0);
+  const __m256i max_lead = _mm256_set1_epi8((char)0xf7);
+
+  __m256i prev = zero;
+  uint32_t prev_high = 0;
+  size_t num_chars = 0, num_lines = 0;
+
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    uint32_t high = (uint32_t)_mm256_movemask_epi8(v);
+
+    if ((high | (prev_high >> 29)) == 0) {
+      num_chars += 32;
     } else {
-      // Go down.
-      iter->s[height].skip_size = offset;
-      iter->s[height].node = e;
-#if ROPE_WCHAR
-      iter->s[height].wchar_size = wchar_pos;
-#endif
+      if ((uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(v, max_lead), v)) != 0xffffffff) break;
 
-      if (height == 0) {
-        break;
-      } else {
-        height--;
-      }
+      __m256i need = _mm256_or_si256(_mm256_or_si256(
+          AVX2_GE(AVX2_PREV(v, prev, 1), lead2),
+          AVX2_GE(AVX2_PREV(v, prev, 2), lead3)),
+          AVX2_GE(AVX2_PREV(v, prev, 3), lead4));
+      __m256i is_cont = _mm256_cmpeq_epi8(_mm256_and_si256(v, cont_mask), cont_bits);
+      if (_mm256_movemask_epi8(_mm256_xor_si256(need, is_cont))) return false;
+
+      num_chars += 32 - __builtin_popcount((uint32_t)_mm256_movemask_epi8(is_cont));
     }
+    num_lines += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, newline)));
+    prev = v;
+    prev_high = high;
   }
 
-#if ROPE_WCHAR
-  // For some reason, this is _REALLY SLOW_. Like, 5.5Mops/s -> 4Mops/s from this block of code.
-  wchar_pos += count_wchars_in_utf8(e->str, offset);
+  counts->num_chars += num_chars;
+  counts->num_lines += num_lines;
+  return scan_utf8_tail(str, p, end, counts);
+}
+#endif
 
-  // The iterator has the wchar pos from the start of the whole string.
-  for (int i = 0; i < r->head.height; i++) {
-    iter->s[i].wchar_size = wchar_pos - iter->s[i].wchar_size;
+typedef bool (*scan_utf8_fn)(const uint8_t *str, size_t num_bytes, utf8_counts *counts);
+static bool scan_utf8_auto(const uint8_t *str, size_t num_bytes, utf8_counts *counts);
+static scan_utf8_fn scan_utf8_kernel = scan_utf8_auto;
+
+ROPE_KERNEL _rope_set_kernel(ROPE_KERNEL kernel) {
+#if ROPE_SIMD_X86
+  if (kernel == ROPE_KERNEL_AUTO) {
+    kernel = __builtin_cpu_supports("avx2") ? ROPE_KERNEL_AVX2
+      : __builtin_cpu_supports("sse2") ? ROPE_KERNEL_SSE2 : ROPE_KERNEL_SCALAR;
+  }
+  if (kernel == ROPE_KERNEL_AVX2 && !__builtin_cpu_supports("avx2")) kernel = ROPE_KERNEL_SSE2;
+  if (kernel == ROPE_KERNEL_SSE2 && !__builtin_cpu_supports("sse2")) kernel = ROPE_KERNEL_SCALAR;
+
+  switch (kernel) {
+    case ROPE_KERNEL_AVX2: scan_utf8_kernel = scan_utf8_avx2; break;
+    case ROPE_KERNEL_SSE2: scan_utf8_kernel = scan_utf8_sse2; break;
+    default: scan_utf8_kernel = scan_utf8_scalar; break;
   }
+  return kernel;
+#else
+  (void)kernel;
+  scan_utf8_kernel = scan_utf8_scalar;
+  return ROPE_KERNEL_SCALAR;
 #endif
+}
 
-  assert(offset <= ROPE_NODE_STR_SIZE);
-  assert(iter->s[0].node == e);
-  return e;
+// The first scan picks the best kernel for this CPU.
+static bool scan_utf8_auto(const uint8_t *str, size_t num_bytes, utf8_counts *counts) {
+  _rope_set_kernel(ROPE_KERNEL_AUTO);
+  return scan_utf8_kernel(str, num_bytes, counts);
 }
 
-#if ROPE_WCHAR
-// Equivalent of iter_at_char_pos, but for wchar positions instead.
-static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter) {
-  int height = r->head.height - 1;
-  assert(wchar_pos <= r->head.nexts[height].wchar_size);
+static inline bool scan_utf8(const uint8_t *str, size_t num_bytes, utf8_counts *counts) {
+  counts->num_chars = counts->num_lines = 0;
+  // Short strings (like single keystrokes) aren't worth the indirect call.
+  if (num_bytes < 16) return scan_utf8_scalar(str, num_bytes, counts);
+  return scan_utf8_kernel(str, num_bytes, counts);
+}
 
-  rope_node *e = &r->head;
+size_t _rope_scan_utf8(const uint8_t *str, size_t num_bytes, size_t *num_lines) {
+  utf8_counts counts;
+  if (!scan_utf8(str, num_bytes, &counts)) return SIZE_MAX;
+  if (num_lines) *num_lines = counts.num_lines;
+  return counts.num_chars;
+}
 
-  // Offset stores how many wchar characters we still need to skip in the current node.
-  size_t offset = wchar_pos;
-  size_t skip;
-  size_t char_pos = 0; // Current char pos from the start of the rope.
+#if ROPE_WCHAR
 
-  while (true) {
-    skip = e->nexts[height].wchar_size;
-    if (offset > skip) {
-      // Go right.
-      offset -= skip;
-      char_pos += e->nexts[height].skip_size;
-      e = e->nexts[height].node;
-    } else {
-      // Go down.
-      iter->s[height].skip_size = char_pos;
-      iter->s[height].node = e;
-      iter->s[height].wchar_size = offset;
+#define NEEDS_TWO_WCHARS(x) (((x) & 0xf0) == 0xf0)
+
+// Only the characters which take 4 bytes in utf8 need two wchars, so the text's wchar count is
+// its character count plus the number of 4 byte lead bytes in it. That's a flat loop over the
+// bytes rather than a walk from character to character.
+static size_t count_wchars(const uint8_t *str, size_t num_bytes, size_t num_chars) {
+  size_t wchars = num_chars, i = 0;
+#if ROPE_SIMD_X86 && defined(__SSE2__)
+  const __m128i lead4 = _mm_set1_epi8((char)0xf0);
+  for (; i + 16 <= num_bytes; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&str[i]);
+    wchars += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, lead4), v)));
+  }
+#endif
+  for (; i < num_bytes; i++) {
+    wchars += NEEDS_TWO_WCHARS(str[i]);
+  }
+  return wchars;
+}
+
+static size_t count_utf8_in_wchars(const uint8_t *str, size_t num_wchars) {
+  size_t chars = num_wchars;
+  for (unsigned int i = 0; i < num_wchars; i++) {
+    if (NEEDS_TWO_WCHARS(*str)) {
+      chars--;
+      i++;
+    }
+    str += codepoint_size(*str);
+  }
+  return chars;
+}
+
+// wchar counts are only worked out when something asks for them. Edits mark the skip entries
+// over the text they change with this, and node_wchars() fills them back in.
+#define WCHARS_UNKNOWN SIZE_MAX
+
+// The number of wchars e's skip entry at height spans. If that isn't known, it's added up from
+// the entries below it (and at the bottom, counted from the text), and kept.
+static size_t node_wchars(rope_node *e, int height) {
+  size_t *wchars = &e->nexts[height].wchar_size;
+  if (*wchars == WCHARS_UNKNOWN) {
+    if (height == 0) {
+      *wchars = count_wchars(e->str, e->num_bytes, e->nexts[0].skip_size);
+    } else {
+      size_t sum = 0;
+      for (rope_node *n = e; n != e->nexts[height].node; n = n->nexts[height - 1].node) {
+        sum += node_wchars(n, height - 1);
+      }
+      *wchars = sum;
+    }
+  }
+  return *wchars;
+}
+
+size_t rope_node_wchars(rope_node *n) {
+  return node_wchars(n, 0);
+}
+#endif
+
+#if ROPE_COLUMNS
+
+// Marks a column summary with no tab or newline in it.
+#define NO_STOP SIZE_MAX
+
+static inline size_t next_tab_stop(size_t col) {
+  return (col / ROPE_TAB_STOP + 1) * ROPE_TAB_STOP;
+}
+
+// Ranges of codepoints which take up no columns (combining marks, joiners and variation
+// selectors) and 2 columns (East Asian wide and fullwidth characters, and emoji). These are the
+// common blocks, not the whole of Unicode's tables.
+static const int32_t zero_width[][2] = {
+  {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+  {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+  {0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0900, 0x0902},
+  {0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d}, {0x0951, 0x0957},
+  {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x1160, 0x11ff}, {0x1ab0, 0x1aff},
+  {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e}, {0x2060, 0x2064}, {0x20d0, 0x20ff},
+  {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0xe0100, 0xe01ef},
+};
+static const int32_t double_width[][2] = {
+  {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x2e80, 0x303e},
+  {0x3041, 0x33ff}, {0x3400, 0x4dbf}, {0x4e00, 0x9fff}, {0xa000, 0xa4cf}, {0xa960, 0xa97f},
+  {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f}, {0xff00, 0xff60},
+  {0xffe0, 0xffe6}, {0x1f300, 0x1f64f}, {0x1f900, 0x1f9ff}, {0x20000, 0x2fffd},
+  {0x30000, 0x3fffd},
+};
+
+static bool in_ranges(int32_t c, const int32_t (*ranges)[2], size_t num_ranges) {
+  size_t lo = 0, hi = num_ranges;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (c < ranges[mid][0]) hi = mid;
+    else if (c > ranges[mid][1]) lo = mid + 1;
+    else return true;
+  }
+  return false;
+}
+
+size_t rope_codepoint_width(int32_t codepoint) {
+  if (codepoint < 0x300) return 1;
+  if (in_ranges(codepoint, zero_width, sizeof(zero_width) / sizeof(zero_width[0]))) return 0;
+  if (in_ranges(codepoint, double_width, sizeof(double_width) / sizeof(double_width[0]))) return 2;
+  return 1;
+}
+
+// The column after the character at p (which is size bytes long), if it starts at col.
+static inline size_t column_after(const uint8_t *p, size_t size, size_t col) {
+  if (*p == '\t') return next_tab_stop(col);
+  if (*p == '\n') return 0;
+  return col + (size == 1 ? 1 : rope_codepoint_width(decode_codepoint(p, size)));
+}
+
+// Summarise how the first num_bytes of str move the display column, into s->cols.
+static void columns_of(rope_skip_node *s, const uint8_t *str, size_t num_bytes) {
+  size_t col = 0;
+  bool stop = false;
+  const uint8_t *p = str, *end = str + num_bytes;
+#if ROPE_SIMD_X86 && defined(__SSE2__)
+  const __m128i space = _mm_set1_epi8(' ');
+#endif
+  while (p < end) {
+    // Most text is printable ASCII, which takes a column a byte.
+#if ROPE_SIMD_X86 && defined(__SSE2__)
+    while (end - p >= 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)p);
+      // Bytes >= 0x80 are negative, so this catches them too.
+      if (_mm_movemask_epi8(_mm_cmplt_epi8(v, space))) break;
+      col += 16;
+      p += 16;
+    }
+    if (p == end) break;
+#endif
+    if (*p >= 0x20 && *p < 0x80) {
+      col++;
+      p++;
+      continue;
+    }
+    size_t size = codepoint_size(*p);
+    if (!stop && (*p == '\t' || *p == '\n')) {
+      // Columns after the first stop count from the tab stop (or the start of the line).
+      s->cols.lead = col;
+      col = 0;
+      stop = true;
+    } else {
+      col = column_after(p, size, col);
+    }
+    p += size;
+  }
+  if (stop) {
+    s->cols.rest = col;
+  } else {
+    s->cols.lead = col;
+    s->cols.rest = NO_STOP;
+  }
+}
+
+// The column after the text s describes, if it starts at col.
+static inline size_t columns_apply(const rope_skip_node *s, size_t col) {
+  if (s->line_size) return s->cols.rest;
+  if (s->cols.rest == NO_STOP) return col + s->cols.lead;
+  return next_tab_stop(col + s->cols.lead) + s->cols.rest;
+}
+
+// Extend the text acc describes with the text s describes. Tab stops are a fixed distance apart,
+// so once acc has a stop in it, the columns after that don't depend on where acc started.
+static void columns_append(rope_skip_node *acc, const rope_skip_node *s) {
+  bool acc_stop = acc->line_size || acc->cols.rest != NO_STOP;
+  if (s->line_size) {
+    acc->cols.rest = s->cols.rest;
+  } else if (acc_stop) {
+    acc->cols.rest = columns_apply(s, acc->cols.rest);
+  } else {
+    acc->cols.rest = s->cols.rest;
+  }
+  if (!acc_stop) acc->cols.lead += s->cols.lead;
+  acc->line_size += s->line_size;
+}
+#endif
+
+typedef struct {
+  // This stores the previous node at each height, and the number of characters from the start of
+  // the previous node to the current iterator position.
+  //
+  // byte_size and line_size are the exception: after a search they only count up to the start of
+  // s[0].node. Call iter_add_in_node() before using them as offsets to the iterator position.
+  // wchar_size isn't kept at all. wchar counts are only worked out by the wchar searches.
+  rope_skip_node s[ROPE_MAX_HEIGHT];
+} rope_iter;
+
+// Count the first num_bytes of e (which must end at the iterator position) into the iterator.
+static void iter_add_in_node(rope *r, rope_iter *iter, rope_node *e, size_t num_bytes) {
+  size_t num_lines = count_newlines(e->str, num_bytes);
+  for (int i = 0; i < r->head.height; i++) {
+    iter->s[i].byte_size += num_bytes;
+    iter->s[i].line_size += num_lines;
+  }
+}
+
+// Internal function for navigating to a particular character offset in the rope.
+// The function returns the list of nodes which point past the position, as well as
+// offsets of how far into their character lists the specified characters are.
+static rope_node *iter_at_char_pos(rope *r, size_t char_pos, rope_iter *iter) {
+  assert(char_pos <= r->num_chars);
+
+  rope_node *e = &r->head;
+  int height = r->head.height - 1;
+
+  // Offset stores how many characters we still need to skip in the current node.
+  size_t offset = char_pos;
+  size_t skip;
+  size_t byte_pos = 0; // Current byte pos from the start of the rope.
+  size_t line_pos = 0; // Current line pos from the start of the rope.
+
+  // The node we went down from at each height, and where it starts in the rope. The search
+  // happens in the finger itself, so it's ready for next time.
+#if ROPE_FINGER
+  rope_skip_node *path = r->finger;
+
+  // Find the lowest node the last search passed through which still spans char_pos, and carry
+  // on from there. The nodes above it are the ones a search from the head would find anyway.
+  for (int i = 0; i < r->finger_height; i++) {
+    rope_skip_node *f = &path[i];
+    if ((f->skip_size < char_pos || f->node == &r->head)
+        && char_pos - f->skip_size <= f->node->nexts[i].skip_size) {
+      e = f->node;
+      height = i;
+      offset = char_pos - f->skip_size;
+      byte_pos = f->byte_size;
+      line_pos = f->line_size;
+      // If the head has grown since the last search, the new heights are all at the head.
+      for (int j = r->finger_height; j < r->head.height; j++) {
+        path[j].node = &r->head;
+        path[j].skip_size = path[j].byte_size = path[j].line_size = 0;
+      }
+      break;
+    }
+  }
+  r->finger_height = r->head.height;
+#else
+  rope_skip_node path[ROPE_MAX_HEIGHT];
+#endif
+
+  while (true) {
+    skip = e->nexts[height].skip_size;
+    if (offset > skip) {
+      // Go right.
+      assert(e == &r->head || e->num_bytes);
+
+      offset -= skip;
+      byte_pos += e->nexts[height].byte_size;
+      line_pos += e->nexts[height].line_size;
+      e = e->nexts[height].node;
+    } else {
+      // Go down.
+      path[height].skip_size = char_pos - offset;
+      path[height].node = e;
+      path[height].byte_size = byte_pos;
+      path[height].line_size = line_pos;
+
+      if (height == 0) {
+        break;
+      } else {
+        height--;
+      }
+    }
+  }
+
+  // The iterator stores the number of characters between the start of each node and the
+  // position, but only the number of bytes and newlines between the start of each node and the
+  // start of e. Counting them inside e is left to the few callers which need it.
+  for (int i = 0; i < r->head.height; i++) {
+    iter->s[i].node = path[i].node;
+    iter->s[i].skip_size = char_pos - path[i].skip_size;
+    iter->s[i].byte_size = byte_pos - path[i].byte_size;
+    iter->s[i].line_size = line_pos - path[i].line_size;
+  }
+
+  assert(offset <= e->num_bytes);
+  assert(iter->s[0].node == e);
+  return e;
+}
+
+#if ROPE_WCHAR
+// Equivalent of iter_at_char_pos, but for wchar positions instead.
+static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter) {
+  // Edits through this iterator would leave the finger behind.
+  finger_reset(r);
+  int height = r->head.height - 1;
+  assert(wchar_pos <= node_wchars(&r->head, height));
+
+  rope_node *e = &r->head;
+
+  // Offset stores how many wchar characters we still need to skip in the current node.
+  size_t offset = wchar_pos;
+  size_t skip;
+  size_t char_pos = 0; // Current char pos from the start of the rope.
+  size_t byte_pos = 0;
+  size_t line_pos = 0;
+
+  // Only the entries this search passes over get counted.
+  while (true) {
+    skip = node_wchars(e, height);
+    if (offset > skip) {
+      // Go right.
+      offset -= skip;
+      char_pos += e->nexts[height].skip_size;
+      byte_pos += e->nexts[height].byte_size;
+      line_pos += e->nexts[height].line_size;
+      e = e->nexts[height].node;
+    } else {
+      // Go down.
+      iter->s[height].skip_size = char_pos;
+      iter->s[height].node = e;
+      iter->s[height].byte_size = byte_pos;
+      iter->s[height].line_size = line_pos;
 
       if (height == 0) {
         break;
@@ -404,45 +1360,141 @@ static rope_node *iter_at_wchar_pos(rope *r, size_t wchar_pos, rope_iter *iter)
   char_pos += count_utf8_in_wchars(e->str, offset);
 
   // The iterator has character positions from the start of the rope to the start of the node.
+  // As with iter_at_char_pos, bytes and lines are counted to the start of e.
   for (int i = 0; i < r->head.height; i++) {
     iter->s[i].skip_size = char_pos - iter->s[i].skip_size;
+    iter->s[i].byte_size = byte_pos - iter->s[i].byte_size;
+    iter->s[i].line_size = line_pos - iter->s[i].line_size;
   }
   assert(e == iter->s[0].node);
   return e;
 }
 #endif
 
-#if ROPE_WCHAR
-static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars, size_t num_wchars) {
+// Equivalent of iter_at_char_pos, but for byte positions. Positions inside a
+// character are rounded down to the start of the character.
+static rope_node *iter_at_byte_pos(rope *r, size_t byte_pos, rope_iter *iter) {
+  assert(byte_pos <= r->num_bytes);
+  // Edits through this iterator would leave the finger behind.
+  finger_reset(r);
+
+  rope_node *e = &r->head;
+  int height = r->head.height - 1;
+
+  // Offset stores how many bytes we still need to skip in the current node.
+  size_t offset = byte_pos;
+  size_t skip;
+  size_t char_pos = 0; // Current char pos from the start of the rope.
+  size_t line_pos = 0;
+
+  while (true) {
+    skip = e->nexts[height].byte_size;
+    if (offset > skip) {
+      // Go right.
+      offset -= skip;
+      char_pos += e->nexts[height].skip_size;
+      line_pos += e->nexts[height].line_size;
+      e = e->nexts[height].node;
+    } else {
+      // Go down.
+      iter->s[height].skip_size = char_pos;
+      iter->s[height].node = e;
+      iter->s[height].byte_size = byte_pos - offset;
+      iter->s[height].line_size = line_pos;
+
+      if (height == 0) {
+        break;
+      } else {
+        height--;
+      }
+    }
+  }
+
+  size_t node_start = byte_pos - offset;
+  while (offset < e->num_bytes && offset > 0 && (e->str[offset] & 0xc0) == 0x80) {
+    offset--;
+  }
+  if (offset == 0 && e != &r->head) {
+    // We rounded back to the start of e, but the rest of the rope expects that position to be
+    // at the end of the previous node. Let iter_at_char_pos sort that out.
+    return iter_at_char_pos(r, char_pos, iter);
+  }
+  char_pos += count_chars_in_utf8(e->str, offset);
+
+  // As with iter_at_char_pos, bytes and lines are counted to the start of e.
   for (int i = 0; i < r->head.height; i++) {
-    iter->s[i].node->nexts[i].skip_size += num_chars;
-    iter->s[i].node->nexts[i].wchar_size += num_wchars;
+    iter->s[i].skip_size = char_pos - iter->s[i].skip_size;
+    iter->s[i].byte_size = node_start - iter->s[i].byte_size;
+    iter->s[i].line_size = line_pos - iter->s[i].line_size;
   }
+  assert(e == iter->s[0].node);
+  return e;
 }
-#else
-static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars) {
+
+static void update_offset_list(rope *r, rope_iter *iter, size_t num_chars, size_t num_bytes,
+    size_t num_lines) {
   for (int i = 0; i < r->head.height; i++) {
     iter->s[i].node->nexts[i].skip_size += num_chars;
+    iter->s[i].node->nexts[i].byte_size += num_bytes;
+    iter->s[i].node->nexts[i].line_size += num_lines;
+#if ROPE_WCHAR
+    iter->s[i].node->nexts[i].wchar_size = WCHARS_UNKNOWN;
+#endif
   }
 }
+
+// Bring the column summaries up to date after an edit changed the text between from and to
+// (character positions in the rope as it is now). Only the spans which touch that range can have
+// changed. Each level is refolded from the one below, so nodes are rescanned but only the spans
+// above them are added up again.
+static void update_columns(rope *r, size_t from, size_t to) {
+#if ROPE_COLUMNS
+  rope_iter iter;
+  iter_at_char_pos(r, from, &iter);
+  for (int i = 0; i < r->head.height; i++) {
+    rope_node *n = iter.s[i].node;
+    for (size_t start = from - iter.s[i].skip_size; n != NULL && start <= to;
+        start += n->nexts[i].skip_size, n = n->nexts[i].node) {
+      rope_skip_node *s = &n->nexts[i];
+      if (i == 0) {
+        columns_of(s, n->str, n->num_bytes);
+        continue;
+      }
+      rope_skip_node acc = {.cols = {0, NO_STOP}};
+      for (rope_node *m = n; m != s->node; m = m->nexts[i - 1].node) {
+        columns_append(&acc, &m->nexts[i - 1]);
+      }
+      s->cols = acc.cols;
+    }
+  }
+#else
+  (void)r;
+  (void)from;
+  (void)to;
 #endif
+}
 
 
 // Internal method of rope_insert.
 // This function creates a new node in the rope at the specified position and fills it with the
-// passed string.
-static void insert_at(rope *r, rope_iter *iter,
-    const uint8_t *str, size_t num_bytes, size_t num_chars) {
-#if ROPE_WCHAR
-  size_t num_wchars = count_wchars_in_utf8(str, num_chars);
-#endif
+// passed string. If borrow is set, the node points at str (which is part of a borrowed node)
+// instead.
+static void insert_at(rope *r, rope_iter *iter, const uint8_t *str, size_t num_bytes,
+    size_t num_chars, size_t num_lines, bool borrow) {
 
   // This describes how many levels of the iter are filled in.
   uint8_t max_height = r->head.height;
-  uint8_t new_height = random_height();
-  rope_node *new_node = alloc_node(r, new_height);
+  uint8_t new_height = random_height(r);
+  rope_node *new_node;
+  if (borrow) {
+    new_node = alloc_node(r, new_height, 0);
+    new_node->str = (uint8_t *)str;
+  } else {
+    new_node = alloc_node(r, new_height,
+        num_bytes > ROPE_NODE_STR_SIZE ? ROPE_LARGE_NODE_STR_SIZE : ROPE_NODE_STR_SIZE);
+    memcpy(new_node->str, str, num_bytes);
+  }
   new_node->num_bytes = num_bytes;
-  memcpy(new_node->str, str, num_bytes);
 
   assert(new_height < ROPE_MAX_HEIGHT);
 
@@ -462,27 +1514,33 @@ static void insert_at(rope *r, rope_iter *iter,
     rope_skip_node *prev_skip = &iter->s[i].node->nexts[i];
     new_node->nexts[i].node = prev_skip->node;
     new_node->nexts[i].skip_size = num_chars + prev_skip->skip_size - iter->s[i].skip_size;
-
+    new_node->nexts[i].byte_size = num_bytes + prev_skip->byte_size - iter->s[i].byte_size;
+    new_node->nexts[i].line_size = num_lines + prev_skip->line_size - iter->s[i].line_size;
 
     prev_skip->node = new_node;
     prev_skip->skip_size = iter->s[i].skip_size;
+    prev_skip->byte_size = iter->s[i].byte_size;
+    prev_skip->line_size = iter->s[i].line_size;
 
     // & move the iterator to the end of the newly inserted node.
     iter->s[i].node = new_node;
     iter->s[i].skip_size = num_chars;
+    iter->s[i].byte_size = num_bytes;
+    iter->s[i].line_size = num_lines;
 #if ROPE_WCHAR
-    new_node->nexts[i].wchar_size = num_wchars + prev_skip->wchar_size - iter->s[i].wchar_size;
-    prev_skip->wchar_size = iter->s[i].wchar_size;
-    iter->s[i].wchar_size = num_wchars;
+    new_node->nexts[i].wchar_size = prev_skip->wchar_size = WCHARS_UNKNOWN;
 #endif
   }
 
   for (; i < max_height; i++) {
     iter->s[i].node->nexts[i].skip_size += num_chars;
     iter->s[i].skip_size += num_chars;
+    iter->s[i].node->nexts[i].byte_size += num_bytes;
+    iter->s[i].byte_size += num_bytes;
+    iter->s[i].node->nexts[i].line_size += num_lines;
+    iter->s[i].line_size += num_lines;
 #if ROPE_WCHAR
-    iter->s[i].node->nexts[i].wchar_size += num_wchars;
-    iter->s[i].wchar_size += num_wchars;
+    iter->s[i].node->nexts[i].wchar_size = WCHARS_UNKNOWN;
 #endif
   }
 
@@ -490,25 +1548,171 @@ static void insert_at(rope *r, rope_iter *iter,
   r->num_bytes += num_bytes;
 }
 
+// The height of the nth node (counting from 1) when building a perfectly balanced list. Every
+// (100 / ROPE_BIAS)th node is one level taller, which matches the distribution random_height()
+// draws from.
+static uint8_t balanced_height(size_t n) {
+  const size_t fanout = 100 / ROPE_BIAS;
+  uint8_t height = 1;
+  while (height < (ROPE_MAX_HEIGHT - 1) && n % fanout == 0) {
+    n /= fanout;
+    height++;
+  }
+  return height;
+}
+
+// Build a balanced rope out of buf. If borrow is set, every node but the head points into buf
+// instead of holding a copy.
+static rope *new_from_buffer(const uint8_t *buf, size_t num_bytes, bool borrow) {
+  assert(buf || num_bytes == 0);
+  rope *r = rope_new();
+
+  // The last node linked in at each height, and the position that node starts at.
+  rope_node *last[ROPE_MAX_HEIGHT];
+  rope_skip_node start[ROPE_MAX_HEIGHT];
+  for (int i = 0; i < ROPE_MAX_HEIGHT; i++) {
+    last[i] = &r->head;
+    start[i].skip_size = start[i].byte_size = start[i].line_size = 0;
+  }
+
+  // Running totals, which are also where the next node starts.
+  rope_skip_node pos = start[0];
+  uint8_t max_height = 0;
+
+  size_t offset = 0;
+  for (size_t n = 0; offset < num_bytes; n++) {
+    // Fill the node up, backing off so we don't split a character.
+    // The first chunk goes in the head, which always exists. The rest go in large nodes.
+    size_t node_bytes = MIN(num_bytes - offset, n == 0 ? r->head.capacity : ROPE_LARGE_NODE_STR_SIZE);
+    if (offset + node_bytes < num_bytes) {
+      while (node_bytes > 0 && (buf[offset + node_bytes] & 0xc0) == 0x80) node_bytes--;
+    }
+
+    const uint8_t *str = &buf[offset];
+    utf8_counts counts;
+    if (node_bytes == 0 || !scan_utf8(str, node_bytes, &counts)) {
+      rope_free(r);
+      return NULL;
+    }
+
+    rope_node *node;
+    if (n == 0) {
+      node = &r->head;
+    } else {
+      node = alloc_node(r, balanced_height(n), borrow ? 0 : ROPE_LARGE_NODE_STR_SIZE);
+      max_height = MAX(max_height, node->height);
+
+      for (int i = 0; i < node->height; i++) {
+        rope_skip_node *skip = &last[i]->nexts[i];
+        skip->node = node;
+        skip->skip_size = pos.skip_size - start[i].skip_size;
+        skip->byte_size = pos.byte_size - start[i].byte_size;
+        skip->line_size = pos.line_size - start[i].line_size;
+#if ROPE_WCHAR
+        skip->wchar_size = WCHARS_UNKNOWN; // Counted by the first wchar search to need it.
+#endif
+        last[i] = node;
+        start[i] = pos;
+      }
+    }
+
+    if (node->capacity) {
+      memcpy(node->str, str, node_bytes);
+    } else {
+      node->str = (uint8_t *)str;
+    }
+    node->num_bytes = node_bytes;
+
+    pos.skip_size += counts.num_chars;
+    pos.byte_size += node_bytes;
+    pos.line_size += counts.num_lines;
+    offset += node_bytes;
+  }
+
+  // The head must be one level taller than any other node. Terminate every level.
+  r->head.height = max_height + 1;
+  for (int i = 0; i < r->head.height; i++) {
+    rope_skip_node *skip = &last[i]->nexts[i];
+    skip->node = NULL;
+    skip->skip_size = pos.skip_size - start[i].skip_size;
+    skip->byte_size = pos.byte_size - start[i].byte_size;
+    skip->line_size = pos.line_size - start[i].line_size;
+#if ROPE_WCHAR
+    skip->wchar_size = WCHARS_UNKNOWN;
+#endif
+  }
+
+  r->num_chars = pos.skip_size;
+  r->num_bytes = pos.byte_size;
+  update_columns(r, 0, r->num_chars);
+
+#if ROPE_CHECK_LEVEL >= 2
+  _rope_check(r);
+#endif
+  return r;
+}
+
+rope *rope_new_from_buffer(const uint8_t *buf, size_t num_bytes) {
+  return new_from_buffer(buf, num_bytes, false);
+}
+
+rope *rope_new_from_mapped(const uint8_t *buf, size_t num_bytes) {
+  return new_from_buffer(buf, num_bytes, true);
+}
+
+// Insert str (which must be valid utf8) at iter as new nodes. The data must be broken into
+// pieces which fit in a node. If large is set, long strings fill as many large nodes as they can.
+// Everything else goes in small nodes. Node boundaries must not occur in the middle of a utf8
+// codepoint.
+static void insert_pieces(rope *r, rope_iter *iter, const uint8_t *str, size_t num_bytes,
+    bool large) {
+  size_t str_offset = 0;
+  while (str_offset < num_bytes) {
+    size_t remaining = num_bytes - str_offset;
+    size_t new_node_bytes = MIN(remaining, large && remaining >= ROPE_LARGE_NODE_STR_SIZE
+        ? ROPE_LARGE_NODE_STR_SIZE : ROPE_NODE_STR_SIZE);
+    while (str_offset + new_node_bytes < num_bytes
+        && (str[str_offset + new_node_bytes] & 0xc0) == 0x80) {
+      new_node_bytes--;
+    }
+
+    // We already know the string is valid. This is just for the counts.
+    utf8_counts node_counts;
+    scan_utf8(&str[str_offset], new_node_bytes, &node_counts);
+
+    insert_at(r, iter, &str[str_offset], new_node_bytes, node_counts.num_chars,
+        node_counts.num_lines, false);
+    str_offset += new_node_bytes;
+  }
+}
+
 // Insert the given utf8 string into the rope at the specified position.
-static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, const uint8_t *str) {
+static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter,
+    const uint8_t *str, size_t num_inserted_bytes) {
   // iter.offset contains how far (in characters) into the current element to skip.
   // Figure out how much that is in bytes.
   size_t offset_bytes = 0;
   // The insertion offset into the destination node.
   size_t offset = iter->s[0].skip_size;
+  // Where the insert is in the rope, and how much of e comes after it. That might get moved into
+  // new nodes, so it's counted as changed too.
+  size_t pos = iter->s[r->head.height - 1].skip_size;
+  size_t tail_chars = e->nexts[0].skip_size - offset;
   if (offset) {
     assert(offset <= e->nexts[0].skip_size);
-    offset_bytes = count_bytes_in_utf8(e->str, offset);
+    offset_bytes = node_char_to_byte(e, offset, e->nexts[0].skip_size);
   }
 
   // We might be able to insert the new data into the current node, depending on
-  // how big it is. We'll count the bytes, and also check that its valid utf8.
-  ssize_t num_inserted_bytes = bytelen_and_check_utf8(str);
-  if (num_inserted_bytes == -1) return ROPE_INVALID_UTF8;
+  // how big it is. Check that its valid utf8, and count it while we're at it.
+  utf8_counts counts;
+  if (!scan_utf8(str, num_inserted_bytes, &counts)) return ROPE_INVALID_UTF8;
 
-  // Can we insert into the current node?
-  bool insert_here = e->num_bytes + num_inserted_bytes <= ROPE_NODE_STR_SIZE;
+  // Can we insert into the current node? We don't insert into the middle of a large node if that
+  // means moving more than a small node's worth of text along. Splitting it instead leaves small
+  // nodes around the edit, which makes the next keystroke cheap.
+  bool insert_here = e->num_bytes + num_inserted_bytes <= e->capacity
+      && e->num_bytes - offset_bytes <= ROPE_NODE_STR_SIZE;
 
   // Can we insert into the subsequent node?
   rope_node *next = NULL;
@@ -519,7 +1723,8 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
     // - There _is_ a next node to insert into
     // - The insert would be at the start of the next node
     // - There's room in the next node
-    if (next && next->num_bytes + num_inserted_bytes <= ROPE_NODE_STR_SIZE) {
+    if (next && next->num_bytes + num_inserted_bytes <= next->capacity
+        && next->num_bytes <= ROPE_NODE_STR_SIZE) {
       offset = offset_bytes = 0;
       for (int i = 0; i < next->height; i++) {
         iter->s[i].node = next;
@@ -532,6 +1737,8 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
   }
 
   if (insert_here) {
+    make_writable(r, e);
+
     // First move the current bytes later on in the string.
     if (offset_bytes < e->num_bytes) {
       memmove(&e->str[offset_bytes + num_inserted_bytes],
@@ -544,66 +1751,49 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
     e->num_bytes += num_inserted_bytes;
 
     r->num_bytes += num_inserted_bytes;
-    size_t num_inserted_chars = strlen_utf8(str);
+    size_t num_inserted_chars = counts.num_chars;
+    size_t num_inserted_lines = counts.num_lines;
     r->num_chars += num_inserted_chars;
 
     // .... aaaand update all the offset amounts.
-#if ROPE_WCHAR
-    size_t num_inserted_wchars = count_wchars_in_utf8(str, num_inserted_chars);
-    update_offset_list(r, iter, num_inserted_chars, num_inserted_wchars);
-#else
-    update_offset_list(r, iter, num_inserted_chars);
-#endif
+    update_offset_list(r, iter, num_inserted_chars, num_inserted_bytes, num_inserted_lines);
 
   } else {
     // There isn't room. We'll need to add at least one new node to the rope.
 
     // If we're not at the end of the current node, we'll need to remove
     // the end of the current node's data and reinsert it later.
-    size_t num_end_chars, num_end_bytes = e->num_bytes - offset_bytes;
+    // insert_at() needs the byte and line offsets to run all the way to the insert position.
+    iter_add_in_node(r, iter, e, offset_bytes);
+
+    size_t num_end_chars, num_end_lines, num_end_bytes = e->num_bytes - offset_bytes;
     if (num_end_bytes) {
       // We'll pretend like the character have been deleted from the node, while leaving
       // the bytes themselves there (for later).
       e->num_bytes = offset_bytes;
       num_end_chars = e->nexts[0].skip_size - offset;
-#if ROPE_WCHAR
-      size_t num_end_wchars = count_wchars_in_utf8(&e->str[offset_bytes], num_end_chars);
-      update_offset_list(r, iter, -num_end_chars, -num_end_wchars);
-#else
-      update_offset_list(r, iter, -num_end_chars);
-#endif
+      num_end_lines = count_newlines(&e->str[offset_bytes], num_end_bytes);
+      update_offset_list(r, iter, -num_end_chars, -num_end_bytes, -num_end_lines);
 
       r->num_chars -= num_end_chars;
       r->num_bytes -= num_end_bytes;
     }
 
-    // Now we insert new nodes containing the new character data. The data must be broken into
-    // pieces of with a maximum size of ROPE_NODE_STR_SIZE. Node boundaries must not occur in the
-    // middle of a utf8 codepoint.
-    size_t str_offset = 0;
-    while (str_offset < num_inserted_bytes) {
-      size_t new_node_bytes = 0;
-      size_t new_node_chars = 0;
-
-      while (str_offset + new_node_bytes < num_inserted_bytes) {
-        size_t cs = codepoint_size(str[str_offset + new_node_bytes]);
-        if (cs + new_node_bytes > ROPE_NODE_STR_SIZE) {
-          break;
-        } else {
-          new_node_bytes += cs;
-          new_node_chars++;
-        }
-      }
-
-      insert_at(r, iter, &str[str_offset], new_node_bytes, new_node_chars);
-      str_offset += new_node_bytes;
-    }
-
+    // Now we insert new nodes containing the new character data. Long strings go in large
+    // nodes. The end of e goes back in small nodes, since it's next to an edit.
+    insert_pieces(r, iter, str, num_inserted_bytes, true);
     if (num_end_bytes) {
-      insert_at(r, iter, &e->str[offset_bytes], num_end_bytes, num_end_chars);
+      if (e->capacity == 0 || num_end_bytes <= ROPE_NODE_STR_SIZE) {
+        // A borrowed node's end can go on pointing at the same place.
+        insert_at(r, iter, &e->str[offset_bytes], num_end_bytes, num_end_chars, num_end_lines,
+            e->capacity == 0);
+      } else {
+        insert_pieces(r, iter, &e->str[offset_bytes], num_end_bytes, false);
+      }
     }
   }
 
+  update_columns(r, pos, pos + counts.num_chars + tail_chars);
   return ROPE_OK;
 }
 
@@ -621,51 +1811,82 @@ static ROPE_RESULT rope_insert_at_iter(rope *r, rope_node *e, rope_iter *iter, c
 
 /* Wrapper function: appends to end of rope */
 ROPE_RESULT rope_append (rope *r, const uint8_t *str) {
-  if (!r->num_bytes)
-    return rope_insert(r, 0, str);
-  return rope_insert(r, rope_byte_count(r), str);
+  return rope_insert(r, rope_char_count(r), str);
+}
+
+ROPE_RESULT rope_append_n (rope *r, const uint8_t *str, size_t num_bytes) {
+  return rope_insert_n(r, rope_char_count(r), str, num_bytes);
 }
 
 ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str) {
-  assert(r);
   assert(str);
-#ifdef DEBUG
-  _rope_check(r);
-#endif
-  pos = MIN(pos, r->num_chars);
+  return rope_insert_n(r, pos, str, strlen((const char *)str));
+}
+
+ROPE_RESULT rope_insert_n(rope *r, size_t pos, const uint8_t *str, size_t num_bytes) {
+  assert(r);
+  assert(str || num_bytes == 0);
+  pos = MIN(pos, r->num_chars);
 
   rope_iter iter;
   // First we need to search for the node where we'll insert the string.
   rope_node *e = iter_at_char_pos(r, pos, &iter);
 
-  ROPE_RESULT result = rope_insert_at_iter(r, e, &iter, str);
+  ROPE_RESULT result = rope_insert_at_iter(r, e, &iter, str, num_bytes);
 
-#ifdef DEBUG
-  _rope_check(r);
-#endif
+  check_edit(r, pos);
+
+  return result;
+}
+
+ROPE_RESULT rope_insert_at_byte(rope *r, size_t byte_pos, const uint8_t *str) {
+  assert(r);
+  assert(str);
+  byte_pos = MIN(byte_pos, r->num_bytes);
+
+  rope_iter iter;
+  rope_node *e = iter_at_byte_pos(r, byte_pos, &iter);
+  size_t pos = iter.s[r->head.height - 1].skip_size;
+
+  ROPE_RESULT result = rope_insert_at_iter(r, e, &iter, str, strlen((const char *)str));
+
+  check_edit(r, pos);
 
   return result;
 }
 
+size_t rope_byte_to_char(rope *r, size_t byte_pos) {
+  assert(r);
+  byte_pos = MIN(byte_pos, r->num_bytes);
+
+  rope_iter iter;
+  iter_at_byte_pos(r, byte_pos, &iter);
+  return iter.s[r->head.height - 1].skip_size;
+}
+
+size_t rope_char_to_byte(rope *r, size_t char_pos) {
+  assert(r);
+  char_pos = MIN(char_pos, r->num_chars);
+
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(r, char_pos, &iter);
+  return iter.s[r->head.height - 1].byte_size + count_bytes_in_utf8(e->str, iter.s[0].skip_size);
+}
+
 #if ROPE_WCHAR
 // Insert the given utf8 string into the rope at the specified position.
 size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *str) {
   assert(r);
   assert(str);
-#ifdef DEBUG
-  _rope_check(r);
-#endif
   wchar_pos = MIN(wchar_pos, rope_wchar_count(r));
 
   rope_iter iter;
   // First we need to search for the node where we'll insert the string.
   rope_node *e = iter_at_wchar_pos(r, wchar_pos, &iter);
   size_t pos = iter.s[r->head.height - 1].skip_size;
-  rope_insert_at_iter(r, e, &iter, str);
+  rope_insert_at_iter(r, e, &iter, str, strlen((const char *)str));
 
-#ifdef DEBUG
-  _rope_check(r);
-#endif
+  check_edit(r, pos);
   return pos;
 }
 
@@ -674,6 +1895,7 @@ size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *str) {
 // Delete num characters at position pos. Deleting past the end of the string
 // has no effect.
 static void rope_del_at_iter(rope *r, rope_node *e, rope_iter *iter, size_t length) {
+  size_t pos = iter->s[r->head.height - 1].skip_size;
   r->num_chars -= length;
   size_t offset = iter->s[0].skip_size;
   while (length) {
@@ -685,20 +1907,24 @@ static void rope_del_at_iter(rope *r, rope_node *e, rope_iter *iter, size_t leng
 
     size_t num_chars = e->nexts[0].skip_size;
     size_t removed = MIN(length, num_chars - offset);
-#if ROPE_WCHAR
-    size_t removed_wchars;
-#endif
+    size_t removed_bytes, removed_lines;
 
     int i;
     if (removed < num_chars || e == &r->head) {
       // Just trim this node down to size.
-      size_t leading_bytes = count_bytes_in_utf8(e->str, offset);
-      size_t removed_bytes = count_bytes_in_utf8(&e->str[leading_bytes], removed);
+      size_t leading_bytes = node_char_to_byte(e, offset, num_chars);
+      if (num_chars - offset - removed < NEAR_NODE_END) {
+        removed_bytes = node_char_to_byte(e, offset + removed, num_chars) - leading_bytes;
+      } else {
+        removed_bytes = count_bytes_in_utf8(&e->str[leading_bytes], removed);
+      }
       size_t trailing_bytes = e->num_bytes - leading_bytes - removed_bytes;
-#if ROPE_WCHAR
-      removed_wchars = count_wchars_in_utf8(&e->str[leading_bytes], removed);
-#endif
-      if (trailing_bytes) {
+      removed_lines = count_newlines(&e->str[leading_bytes], removed_bytes);
+      if (trailing_bytes && e->capacity == 0 && leading_bytes == 0) {
+        // Trimming the start of a borrowed node. It can just point further along.
+        e->str += removed_bytes;
+      } else if (trailing_bytes) {
+        make_writable(r, e);
         memmove(&e->str[leading_bytes], &e->str[leading_bytes + removed_bytes], trailing_bytes);
       }
       e->num_bytes -= removed_bytes;
@@ -706,50 +1932,51 @@ static void rope_del_at_iter(rope *r, rope_node *e, rope_iter *iter, size_t leng
 
       for (i = 0; i < e->height; i++) {
         e->nexts[i].skip_size -= removed;
+        e->nexts[i].byte_size -= removed_bytes;
+        e->nexts[i].line_size -= removed_lines;
 #if ROPE_WCHAR
-        e->nexts[i].wchar_size -= removed_wchars;
+        e->nexts[i].wchar_size = WCHARS_UNKNOWN;
 #endif
       }
     } else {
       // Remove the node from the list
-#if ROPE_WCHAR
-      removed_wchars = e->nexts[0].wchar_size;
-#endif
+      removed_bytes = e->num_bytes;
+      removed_lines = e->nexts[0].line_size;
       for (i = 0; i < e->height; i++) {
         iter->s[i].node->nexts[i].node = e->nexts[i].node;
         iter->s[i].node->nexts[i].skip_size += e->nexts[i].skip_size - removed;
+        iter->s[i].node->nexts[i].byte_size += e->nexts[i].byte_size - removed_bytes;
+        iter->s[i].node->nexts[i].line_size += e->nexts[i].line_size - removed_lines;
 #if ROPE_WCHAR
-        iter->s[i].node->nexts[i].wchar_size += e->nexts[i].wchar_size - removed_wchars;
+        iter->s[i].node->nexts[i].wchar_size = WCHARS_UNKNOWN;
 #endif
       }
 
       r->num_bytes -= e->num_bytes;
-      // TODO: Recycle e.
       rope_node *next = e->nexts[0].node;
 #if REF_COUNT
-      ref_dec(e);
-#else
-      r->free(e);
+      if (ref_dec(e) == 0)
 #endif
+        recycle_node(r, e);
       e = next;
     }
 
     for (; i < r->head.height; i++) {
       iter->s[i].node->nexts[i].skip_size -= removed;
+      iter->s[i].node->nexts[i].byte_size -= removed_bytes;
+      iter->s[i].node->nexts[i].line_size -= removed_lines;
 #if ROPE_WCHAR
-      iter->s[i].node->nexts[i].wchar_size -= removed_wchars;
+      iter->s[i].node->nexts[i].wchar_size = WCHARS_UNKNOWN;
 #endif
     }
 
     length -= removed;
   }
+
+  update_columns(r, pos, pos);
 }
 
 void rope_del(rope *r, size_t pos, size_t length) {
-#ifdef DEBUG
-  _rope_check(r);
-#endif
-
   assert(r);
   pos = MIN(pos, r->num_chars);
   length = MIN(length, r->num_chars - pos);
@@ -761,17 +1988,912 @@ void rope_del(rope *r, size_t pos, size_t length) {
 
   rope_del_at_iter(r, e, &iter, length);
 
-#ifdef DEBUG
-  _rope_check(r);
+  check_edit(r, pos);
+}
+
+// A position in the rope, walked forward one node at a time by apply_edits.
+typedef struct {
+  rope_node *node;
+  size_t offset; // In characters.
+  size_t offset_bytes;
+} edit_walk;
+
+// Step w forward num_chars characters, copying them to dest unless it's NULL. Returns the number
+// of bytes stepped over, or SIZE_MAX (leaving w alone) if that would be more than max_bytes.
+static size_t walk_chars(edit_walk *w, size_t num_chars, uint8_t *dest, size_t max_bytes) {
+  edit_walk pos = *w;
+  size_t num_bytes = 0;
+  while (num_chars) {
+    rope_node *e = pos.node;
+    if (pos.offset == e->nexts[0].skip_size) {
+      pos.node = e->nexts[0].node;
+      pos.offset = pos.offset_bytes = 0;
+      continue;
+    }
+    size_t chunk_chars = MIN(num_chars, e->nexts[0].skip_size - pos.offset);
+    size_t chunk_bytes = chunk_chars == e->nexts[0].skip_size - pos.offset
+        ? e->num_bytes - pos.offset_bytes
+        : count_bytes_in_utf8(&e->str[pos.offset_bytes], chunk_chars);
+    if (num_bytes + chunk_bytes > max_bytes) return SIZE_MAX;
+    if (dest) memcpy(&dest[num_bytes], &e->str[pos.offset_bytes], chunk_bytes);
+    num_bytes += chunk_bytes;
+    num_chars -= chunk_chars;
+    pos.offset += chunk_chars;
+    pos.offset_bytes += chunk_bytes;
+  }
+  *w = pos;
+  return num_bytes;
+}
+
+ROPE_RESULT rope_apply_edits(rope *r, const rope_edit *edits, size_t num_edits) {
+  assert(r);
+  assert(edits || num_edits == 0);
+
+  // Check everything before changing anything.
+  for (size_t i = 0; i < num_edits; i++) {
+    assert(i == 0 || edits[i].pos >= edits[i - 1].pos + edits[i - 1].num_deleted);
+    utf8_counts counts;
+    if (!scan_utf8(edits[i].str, edits[i].num_bytes, &counts)) return ROPE_INVALID_UTF8;
+  }
+
+  // Edits close together are spliced into one replacement: the inserted strings with the text
+  // between them copied in, up to a large node's worth. Then the whole group costs one search,
+  // one delete and one insert instead of one of each per edit.
+  uint8_t buf[ROPE_LARGE_NODE_STR_SIZE];
+
+  // Positions are clamped in the rope as it was before the batch. Every group so far was before
+  // the current one, so they've moved it by exactly as much as they've changed the length of
+  // the rope.
+  size_t num_chars_before = r->num_chars;
+  size_t pos = 0;
+  for (size_t i = 0; i < num_edits;) {
+    size_t start = MIN(edits[i].pos, num_chars_before);
+    size_t end = start + MIN(edits[i].num_deleted, num_chars_before - start);
+    pos = start + (r->num_chars - num_chars_before);
+
+    // This search picks up from the finger the last group left, so it only goes as far as the
+    // distance between groups. Deleting only changes the rope after pos, so the same iterator
+    // can be used for the insert.
+    rope_iter iter;
+    rope_node *e = iter_at_char_pos(r, pos, &iter);
+
+    const uint8_t *str = edits[i].str;
+    size_t num_bytes = edits[i].num_bytes;
+    size_t j = i + 1;
+    if (j < num_edits && num_bytes <= sizeof(buf)) {
+      edit_walk w = {e, iter.s[0].skip_size, 0};
+      w.offset_bytes = w.offset ? node_char_to_byte(e, w.offset, e->nexts[0].skip_size) : 0;
+      walk_chars(&w, end - start, NULL, SIZE_MAX);
+      if (num_bytes) memcpy(buf, str, num_bytes);
+      for (; j < num_edits; j++) {
+        size_t next = MIN(edits[j].pos, num_chars_before);
+        edit_walk gap_end = w;
+        size_t gap_bytes = walk_chars(&gap_end, next - end, &buf[num_bytes],
+            sizeof(buf) - num_bytes);
+        if (gap_bytes == SIZE_MAX || num_bytes + gap_bytes + edits[j].num_bytes > sizeof(buf)) {
+          break;
+        }
+        num_bytes += gap_bytes;
+        if (edits[j].num_bytes) memcpy(&buf[num_bytes], edits[j].str, edits[j].num_bytes);
+        num_bytes += edits[j].num_bytes;
+        size_t num_deleted = MIN(edits[j].num_deleted, num_chars_before - next);
+        w = gap_end;
+        walk_chars(&w, num_deleted, NULL, SIZE_MAX);
+        end = next + num_deleted;
+      }
+      if (j > i + 1) str = buf;
+    }
+
+    if (end > start) rope_del_at_iter(r, e, &iter, end - start);
+    if (num_bytes) rope_insert_at_iter(r, e, &iter, str, num_bytes);
+    i = j;
+  }
+
+  check_edit(r, pos);
+  return ROPE_OK;
+}
+
+void rope_del_bytes(rope *r, size_t byte_pos, size_t num_bytes) {
+  assert(r);
+  byte_pos = MIN(byte_pos, r->num_bytes);
+  num_bytes = MIN(num_bytes, r->num_bytes - byte_pos);
+
+  // Find the end first, so the search we delete through is the last one.
+  size_t end_char_pos = rope_byte_to_char(r, byte_pos + num_bytes);
+  rope_iter iter;
+  rope_node *e = iter_at_byte_pos(r, byte_pos, &iter);
+  size_t pos = iter.s[r->head.height - 1].skip_size;
+
+  rope_del_at_iter(r, e, &iter, end_char_pos - pos);
+
+  check_edit(r, pos);
+}
+
+// Lower the head to one level above the tallest node left in the rope.
+static void trim_height(rope *r) {
+  while (r->head.height > 1 && r->head.nexts[r->head.height - 2].node == NULL) {
+    r->head.height--;
+  }
+}
+
+rope *rope_split_at(rope *r, size_t pos) {
+  assert(r);
+  pos = MIN(pos, r->num_chars);
+
+  rope *right = (rope *)r->alloc(ROPE_SIZE);
+  right->alloc = r->alloc;
+  right->realloc = r->realloc;
+  right->free = r->free;
+#if ROPE_POOL
+  // The nodes after pos stay where they are, so both halves share the pool.
+  right->pool = pool_get(r);
+  right->pool->num_refs++;
+#endif
+  recycle_init(right);
+  finger_reset(right);
+  rope_set_seed(right, random_u64(r));
+  right->compact_pos = 0;
+#if ROPE_CHECK_LEVEL >= 2
+  right->num_unchecked_edits = 0;
 #endif
+  head_init_str(right);
+  right->head.height = r->head.height;
+#if REF_COUNT
+  right->head.ref_count = 1;
+#endif
+
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(r, pos, &iter);
+  size_t offset_bytes = count_bytes_in_utf8(e->str, iter.s[0].skip_size);
+  iter_add_in_node(r, &iter, e, offset_bytes);
+
+  size_t tail_bytes = e->num_bytes - offset_bytes;
+  e->num_bytes = offset_bytes;
+
+  // At each level, the last node before pos now ends the left rope, and whatever it pointed to is
+  // pointed to by the new head instead.
+  for (int i = 0; i < r->head.height; i++) {
+    rope_skip_node *prev_skip = &iter.s[i].node->nexts[i];
+    rope_skip_node *skip = &right->head.nexts[i];
+    skip->node = prev_skip->node;
+    skip->skip_size = prev_skip->skip_size - iter.s[i].skip_size;
+    skip->byte_size = prev_skip->byte_size - iter.s[i].byte_size;
+    skip->line_size = prev_skip->line_size - iter.s[i].line_size;
+    *prev_skip = iter.s[i];
+    prev_skip->node = NULL;
+#if ROPE_WCHAR
+    skip->wchar_size = prev_skip->wchar_size = WCHARS_UNKNOWN;
+#endif
+  }
+
+  // The rest of e becomes the new rope's head. If it came from a large node it might not fit,
+  // in which case it goes in a node of its own just after the (empty) head.
+  if (tail_bytes <= right->head.capacity) {
+    right->head.num_bytes = tail_bytes;
+    memcpy(right->head.str, &e->str[offset_bytes], tail_bytes);
+  } else {
+    rope_node *x = alloc_node(right, random_height(right), e->capacity);
+    x->num_bytes = tail_bytes;
+    if (e->capacity) {
+      memcpy(x->str, &e->str[offset_bytes], tail_bytes);
+    } else {
+      x->str = &e->str[offset_bytes];
+    }
+    for (; right->head.height <= x->height; right->head.height++) {
+      right->head.nexts[right->head.height] = right->head.nexts[right->head.height - 1];
+    }
+    for (int i = 0; i < x->height; i++) {
+      x->nexts[i] = right->head.nexts[i];
+      rope_skip_node *skip = &right->head.nexts[i];
+      skip->node = x;
+      skip->skip_size = skip->byte_size = skip->line_size = 0;
+#if ROPE_WCHAR
+      skip->wchar_size = 0;
+#endif
+    }
+    right->head.num_bytes = 0;
+  }
+
+  size_t top = r->head.height - 1;
+  right->num_chars = r->num_chars - pos;
+  right->num_bytes = r->num_bytes - iter.s[top].byte_size;
+  r->num_chars = pos;
+  r->num_bytes = iter.s[top].byte_size;
+
+  trim_height(r);
+  trim_height(right);
+  finger_reset(r);
+  update_columns(r, pos, pos);
+  update_columns(right, 0, 0);
+  check_edit(r, pos);
+  check_edit(right, 0);
+  return right;
 }
 
+void rope_concat(rope *a, rope *b) {
+  assert(a && b && a != b);
+  assert(a->alloc == b->alloc && a->free == b->free);
+
+#if ROPE_POOL
+  rope_pool *pa = pool_get(a), *pb = pool_get(b);
+  if (pa != pb) pool_merge(a, pa, pb);
+#endif
+  for (int h = 0; h < ROPE_MAX_HEIGHT; h++) {
+    rope_node *next;
+    for (rope_node *n = b->recycled[h]; n != NULL; n = next) {
+      next = n->nexts[0].node;
+      free_node(a, n);
+    }
+  }
+
+  // The last node at each level. These all point off the end of a.
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(a, a->num_chars, &iter);
+
+  // b's head can't be linked in as it is, so its contents either go on the end of e or into a
+  // node of their own.
+  rope_node *x = NULL;
+  size_t head_bytes = b->head.num_bytes;
+  if (head_bytes == 0) {
+    // Nothing to move. (e might be a borrowed node, with no room at all.)
+  } else if (e->num_bytes + head_bytes <= e->capacity) {
+    make_writable(a, e);
+    memcpy(&e->str[e->num_bytes], b->head.str, head_bytes);
+    e->num_bytes += head_bytes;
+  } else {
+    x = alloc_node(a, random_height(a), ROPE_NODE_STR_SIZE);
+    x->num_bytes = head_bytes;
+    memcpy(x->str, b->head.str, head_bytes);
+  }
+
+  uint8_t height_b = b->head.height;
+  uint8_t height = MAX(a->head.height, height_b);
+  if (x) height = MAX(height, x->height + 1);
+  for (int i = a->head.height; i < height; i++) {
+    a->head.nexts[i] = a->head.nexts[i - 1];
+    iter.s[i].node = &a->head;
+  }
+  a->head.height = height;
+
+  for (int i = 0; i < height; i++) {
+    // What b's head pointed to at this level. Past b's height, that's the end of b.
+    rope_skip_node *bn = &b->head.nexts[MIN(i, height_b - 1)];
+    rope_skip_node *prev_skip = &iter.s[i].node->nexts[i];
+    if (x && i < x->height) {
+      x->nexts[i] = *bn;
+      prev_skip->node = x;
+    } else {
+      prev_skip->node = bn->node;
+      prev_skip->skip_size += bn->skip_size;
+      prev_skip->byte_size += bn->byte_size;
+      prev_skip->line_size += bn->line_size;
 #if ROPE_WCHAR
-size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *char_len_out) {
-#ifdef DEBUG
-  _rope_check(r);
+      prev_skip->wchar_size = WCHARS_UNKNOWN;
+#endif
+    }
+  }
+
+  size_t pos = a->num_chars;
+  a->num_chars += b->num_chars;
+  a->num_bytes += b->num_bytes;
+  finger_reset(a);
+  update_columns(a, pos, pos);
+  check_edit(a, pos);
+
+#if ROPE_POOL
+  pool_release(b, b->pool);
+#endif
+  b->free(b);
+}
+
+// The most nodes rope_compact will merge at once.
+#define COMPACT_RUN_NODES 16
+
+int rope_compact(rope *r, size_t max_nodes) {
+  assert(r);
+  uint8_t buf[COMPACT_RUN_NODES * ROPE_NODE_STR_SIZE];
+
+  for (size_t visited = 0; visited < max_nodes; ) {
+    // Edits since the last call can leave compact_pos anywhere, including past the end.
+    if (r->compact_pos >= r->num_chars) {
+      r->compact_pos = 0;
+      return 1;
+    }
+
+    rope_iter iter;
+    rope_node *e = iter_at_char_pos(r, r->compact_pos, &iter);
+    size_t offset = iter.s[0].skip_size;
+    rope_node *n = e;
+    if (offset == e->nexts[0].skip_size) {
+      // Searches for the start of a node land at the end of the one before.
+      n = e->nexts[0].node;
+    } else if (offset > 0) {
+      // Partway into a node. Start at the next one.
+      r->compact_pos += e->nexts[0].skip_size - offset;
+      visited++;
+      continue;
+    }
+
+    // Gather up underfull nodes until one is full or they won't fit in buf.
+    size_t run_nodes = 0, run_bytes = 0, run_chars = 0;
+    for (; n != NULL && run_bytes + n->num_bytes <= sizeof(buf)
+        && n->num_bytes < ROPE_NODE_STR_SIZE; n = n->nexts[0].node) {
+      memcpy(&buf[run_bytes], n->str, n->num_bytes);
+      run_nodes++;
+      run_bytes += n->num_bytes;
+      run_chars += n->nexts[0].skip_size;
+    }
+
+    if (run_nodes == 0) {
+      // The node is full. Skip over it.
+      r->compact_pos += n->nexts[0].skip_size;
+      visited++;
+      continue;
+    }
+    visited += run_nodes;
+
+    // Replacing the run with its own contents packs it into full nodes (and tops up the node
+    // before it, if that has room).
+    if ((run_bytes + ROPE_NODE_STR_SIZE - 1) / ROPE_NODE_STR_SIZE < run_nodes) {
+      rope_del_at_iter(r, e, &iter, run_chars);
+      ROPE_RESULT result = rope_insert_at_iter(r, e, &iter, buf, run_bytes);
+      assert(result == ROPE_OK);
+      (void)result;
+      check_edit(r, r->compact_pos);
+    }
+    r->compact_pos += run_chars;
+  }
+  return 0;
+}
+
+double rope_fill_ratio(const rope *r) {
+  assert(r);
+  size_t capacity = 0;
+  for (const rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
+    // Borrowed nodes don't have any room to waste.
+    capacity += n->capacity ? n->capacity : n->num_bytes;
+  }
+  return (double)r->num_bytes / capacity;
+}
+
+void rope_stats(const rope *r, rope_stats_info *stats) {
+  assert(r && stats);
+  memset(stats, 0, sizeof(rope_stats_info));
+  stats->payload_bytes = r->num_bytes;
+  stats->head_height = r->head.height;
+  stats->allocated_bytes = ROPE_SIZE;
+
+  for (const rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
+    stats->num_nodes++;
+    stats->height_histogram[n->height - 1]++;
+    size_t fill = 9;
+    if (n->capacity) fill = MIN(n->num_bytes * 10 / n->capacity, 9);
+    stats->fill_histogram[fill]++;
+
+    if (n->capacity == 0) {
+      stats->num_borrowed_nodes++;
+    } else if (n->capacity > ROPE_NODE_STR_SIZE) {
+      stats->num_large_nodes++;
+      stats->allocated_bytes += STR_HEADER_SIZE + n->capacity;
+    }
+#if !ROPE_POOL
+    if (n != &r->head) stats->allocated_bytes += node_size(n->height, n->capacity);
+#endif
+  }
+
+  for (int h = 0; h < ROPE_MAX_HEIGHT; h++) {
+    stats->num_recycled_nodes += r->num_recycled[h];
+#if !ROPE_POOL
+    stats->allocated_bytes += r->num_recycled[h] * node_size(h + 1, ROPE_NODE_STR_SIZE);
+#endif
+  }
+
+#if ROPE_POOL
+  // Nodes are carved out of slabs, so count the slabs instead.
+  const rope_pool *p = r->pool;
+  while (p->merged_into) p = p->merged_into;
+  stats->allocated_bytes += sizeof(rope_pool);
+  for (int c = 0; c < NUM_POOL_CLASSES; c++) {
+    const rope_node_pool *np = &p->classes[c];
+    stats->allocated_bytes += np->max_slabs * sizeof(rope_slab *);
+    for (size_t i = 0; i < np->num_slabs; i++) {
+      stats->allocated_bytes += sizeof(rope_slab) + np->slabs[i]->capacity * np->slabs[i]->stride;
+    }
+  }
 #endif
 
+  // A search for a position in the span after the kth node of a level (counting from the last
+  // node which is also in the level above) moves right k times at that level, and then goes down.
+  size_t total_moves = 0;
+  for (int i = 0; i < r->head.height; i++) {
+    size_t k = 0;
+    for (const rope_node *n = &r->head; n != NULL; n = n->nexts[i].node) {
+      if (n->height > i + 1) k = 0;
+      total_moves += k * n->nexts[i].skip_size;
+      k++;
+    }
+  }
+  stats->avg_search_path = r->head.height
+      + (r->num_chars ? (double)total_moves / r->num_chars : 0);
+}
+
+size_t rope_char_to_line(rope *r, size_t pos) {
+  assert(r);
+  pos = MIN(pos, r->num_chars);
+
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(r, pos, &iter);
+
+  // The top of the iterator is the head, so its offset is from the start of the rope.
+  return iter.s[r->head.height - 1].line_size
+    + count_newlines(e->str, count_bytes_in_utf8(e->str, iter.s[0].skip_size));
+}
+
+size_t rope_line_to_char(rope *r, size_t line) {
+  assert(r);
+  int height = r->head.height - 1;
+  if (line == 0) return 0;
+  if (line > r->head.nexts[height].line_size) return r->num_chars;
+
+  rope_node *e = &r->head;
+  size_t char_pos = 0;
+  // The number of newlines we still need to pass.
+  size_t remaining = line;
+
+  while (true) {
+    if (e->nexts[height].line_size < remaining) {
+      // Go right.
+      remaining -= e->nexts[height].line_size;
+      char_pos += e->nexts[height].skip_size;
+      e = e->nexts[height].node;
+    } else if (height == 0) {
+      break;
+    } else {
+      // Go down.
+      height--;
+    }
+  }
+
+  // The line starts just after the remaining'th newline in e.
+  const uint8_t *p = e->str;
+  while (true) {
+    p = (const uint8_t *)memchr(p, '\n', &e->str[e->num_bytes] - p);
+    assert(p);
+    p++;
+    if (--remaining == 0) break;
+  }
+  return char_pos + count_chars_in_utf8(e->str, p - e->str);
+}
+
+#if ROPE_COLUMNS
+size_t rope_char_to_column(rope *r, size_t pos) {
+  assert(r);
+  pos = MIN(pos, r->num_chars);
+
+  rope_node *e = &r->head;
+  int height = r->head.height - 1;
+  // Summaries with a newline in them reset the column, so adding them up from the start of the
+  // rope gives the column in pos's line.
+  size_t offset = pos, col = 0;
+  while (true) {
+    rope_skip_node *s = &e->nexts[height];
+    if (offset > s->skip_size) {
+      // Go right.
+      offset -= s->skip_size;
+      col = columns_apply(s, col);
+      e = s->node;
+    } else if (height == 0) {
+      break;
+    } else {
+      // Go down.
+      height--;
+    }
+  }
+
+  size_t num_bytes = count_bytes_in_utf8(e->str, offset);
+  rope_skip_node in_node = {.line_size = count_newlines(e->str, num_bytes)};
+  columns_of(&in_node, e->str, num_bytes);
+  return columns_apply(&in_node, col);
+}
+
+size_t rope_column_to_char(rope *r, size_t line, size_t column) {
+  assert(r);
+  int height = r->head.height - 1;
+  if (line > r->head.nexts[height].line_size) return r->num_chars;
+
+  rope_node *e = &r->head;
+  size_t char_pos = 0, line_pos = 0, col = 0;
+  // Go right over anything which ends before the line, or on the line at or before column.
+  while (true) {
+    rope_skip_node *s = &e->nexts[height];
+    size_t next_line = line_pos + s->line_size;
+    size_t next_col = columns_apply(s, col);
+    if (s->node && (next_line < line || (next_line == line && next_col <= column))) {
+      char_pos += s->skip_size;
+      line_pos = next_line;
+      col = next_col;
+      e = s->node;
+    } else if (height == 0) {
+      break;
+    } else {
+      height--;
+    }
+  }
+
+  // Then the same a character at a time through e.
+  for (const uint8_t *p = e->str, *end = &e->str[e->num_bytes]; p < end; ) {
+#if ROPE_SIMD_X86 && defined(__SSE2__)
+    // Skip along 16 columns at a time through printable ASCII.
+    if (line_pos == line && end - p >= 16 && col + 16 <= column
+        && !_mm_movemask_epi8(_mm_cmplt_epi8(_mm_loadu_si128((const __m128i *)p),
+            _mm_set1_epi8(' ')))) {
+      char_pos += 16;
+      col += 16;
+      p += 16;
+      continue;
+    }
+#endif
+    size_t size = codepoint_size(*p);
+    size_t next_line = line_pos + (*p == '\n');
+    size_t next_col = column_after(p, size, col);
+    if (next_line > line || (next_line == line && next_col > column)) break;
+    char_pos++;
+    line_pos = next_line;
+    col = next_col;
+    p += size;
+  }
+  return char_pos;
+}
+#endif
+
+// Point c at the position an iterator search ended on.
+static void cursor_from_iter(rope *r, rope_cursor *c, rope_node *e, rope_iter *iter) {
+  // The top of the iterator is the head, so its offsets are from the start of the rope.
+  int top = r->head.height - 1;
+  c->r = r;
+  c->node = e;
+  c->offset = count_bytes_in_utf8(e->str, iter->s[0].skip_size);
+  c->char_pos = iter->s[top].skip_size;
+  c->byte_pos = iter->s[top].byte_size + c->offset;
+  c->node_char_pos = c->char_pos - iter->s[0].skip_size;
+  c->node_line_pos = iter->s[top].line_size;
+  c->line_pos = c->node_line_pos + count_newlines(e->str, c->offset);
+}
+
+// Searches leave the cursor at the end of a node rather than the start of the next one. Move
+// it forward so the character after the cursor is always in c->node.
+static void cursor_skip_to_next_node(rope_cursor *c) {
+  while (c->offset == c->node->num_bytes && c->node->nexts[0].node) {
+    c->node_char_pos += c->node->nexts[0].skip_size;
+    c->node_line_pos += c->node->nexts[0].line_size;
+    c->node = c->node->nexts[0].node;
+    c->offset = 0;
+  }
+}
+
+// Nodes only link forward, so stepping back over the start of one means searching for the end
+// of the previous node from the head.
+static void cursor_back_to_prev_node(rope_cursor *c) {
+  assert(c->offset == 0 && c->char_pos > 0);
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(c->r, c->char_pos, &iter);
+  cursor_from_iter(c->r, c, e, &iter);
+  assert(c->offset == e->num_bytes);
+}
+
+void rope_cursor_at_char(rope *r, rope_cursor *c, size_t char_pos) {
+  assert(r);
+  char_pos = MIN(char_pos, r->num_chars);
+
+  rope_iter iter;
+  rope_node *e = iter_at_char_pos(r, char_pos, &iter);
+  cursor_from_iter(r, c, e, &iter);
+  cursor_skip_to_next_node(c);
+}
+
+void rope_cursor_at_byte(rope *r, rope_cursor *c, size_t byte_pos) {
+  assert(r);
+  byte_pos = MIN(byte_pos, r->num_bytes);
+
+  rope_iter iter;
+  rope_node *e = iter_at_byte_pos(r, byte_pos, &iter);
+  cursor_from_iter(r, c, e, &iter);
+  cursor_skip_to_next_node(c);
+}
+
+void rope_cursor_at_line(rope *r, rope_cursor *c, size_t line) {
+  rope_cursor_at_char(r, c, rope_line_to_char(r, line));
+}
+
+int32_t rope_cursor_peek(const rope_cursor *c) {
+  if (c->offset == c->node->num_bytes) return -1;
+  const uint8_t *p = &c->node->str[c->offset];
+  return decode_codepoint(p, codepoint_size(*p));
+}
+
+int32_t rope_cursor_next(rope_cursor *c) {
+  if (c->offset == c->node->num_bytes) return -1;
+  const uint8_t *p = &c->node->str[c->offset];
+  size_t size = codepoint_size(*p);
+  int32_t codepoint = decode_codepoint(p, size);
+
+  c->offset += size;
+  c->byte_pos += size;
+  c->char_pos++;
+  if (codepoint == '\n') c->line_pos++;
+  cursor_skip_to_next_node(c);
+  return codepoint;
+}
+
+int32_t rope_cursor_prev(rope_cursor *c) {
+  if (c->offset == 0) {
+    if (c->char_pos == 0) return -1;
+    cursor_back_to_prev_node(c);
+  }
+
+  size_t end = c->offset;
+  do {
+    c->offset--;
+  } while ((c->node->str[c->offset] & 0xc0) == 0x80);
+  int32_t codepoint = decode_codepoint(&c->node->str[c->offset], end - c->offset);
+
+  c->byte_pos -= end - c->offset;
+  c->char_pos--;
+  if (codepoint == '\n') c->line_pos--;
+  return codepoint;
+}
+
+int rope_cursor_next_line(rope_cursor *c) {
+  // Lines are usually short, so look for the newline in this node before searching the rope.
+  const uint8_t *str = c->node->str;
+  const uint8_t *nl = (const uint8_t *)memchr(&str[c->offset], '\n',
+      c->node->num_bytes - c->offset);
+  if (nl) {
+    size_t line_start = nl + 1 - str;
+    c->char_pos += count_chars_in_utf8(&str[c->offset], line_start - c->offset);
+    c->byte_pos += line_start - c->offset;
+    c->line_pos++;
+    c->offset = line_start;
+    cursor_skip_to_next_node(c);
+    return 1;
+  }
+
+  if (c->line_pos + 1 >= rope_line_count(c->r)) return 0;
+  rope_cursor_at_line(c->r, c, c->line_pos + 1);
+  return 1;
+}
+
+int rope_cursor_prev_line(rope_cursor *c) {
+  if (c->line_pos == 0) return 0;
+
+  // The previous line starts just after the second newline back from the cursor.
+  const uint8_t *str = c->node->str;
+  size_t line_start = c->offset;
+  int seen = 0;
+  while (line_start > 0) {
+    if (str[line_start - 1] == '\n' && ++seen == 2) break;
+    line_start--;
+  }
+
+  if (seen == 2) {
+    c->char_pos -= count_chars_in_utf8(&str[line_start], c->offset - line_start);
+    c->byte_pos -= c->offset - line_start;
+    c->line_pos--;
+    c->offset = line_start;
+  } else {
+    rope_cursor_at_line(c->r, c, c->line_pos - 1);
+  }
+  return 1;
+}
+
+const uint8_t *rope_cursor_chunk(const rope_cursor *c, size_t *num_bytes) {
+  *num_bytes = c->node->num_bytes - c->offset;
+  return &c->node->str[c->offset];
+}
+
+int rope_cursor_next_chunk(rope_cursor *c) {
+  rope_node *n = c->node;
+  if (c->offset == n->num_bytes) return 0;
+
+  c->char_pos = c->node_char_pos + n->nexts[0].skip_size;
+  c->line_pos = c->node_line_pos + n->nexts[0].line_size;
+  c->byte_pos += n->num_bytes - c->offset;
+  c->offset = n->num_bytes;
+  cursor_skip_to_next_node(c);
+  return 1;
+}
+
+int rope_cursor_prev_chunk(rope_cursor *c) {
+  if (c->offset == 0) {
+    if (c->char_pos == 0) return 0;
+    cursor_back_to_prev_node(c);
+  }
+
+  c->byte_pos -= c->offset;
+  c->char_pos = c->node_char_pos;
+  c->line_pos = c->node_line_pos;
+  c->offset = 0;
+  return 1;
+}
+
+// Both of these walk the range a node at a time from a single search. Only the last node in the
+// range needs its characters counted.
+size_t rope_copy_range(rope *r, size_t pos, size_t num_chars, uint8_t *dest) {
+  assert(r);
+  rope_cursor c;
+  rope_cursor_at_char(r, &c, pos);
+  num_chars = MIN(num_chars, r->num_chars - c.char_pos);
+
+  uint8_t *p = dest;
+  while (num_chars) {
+    rope_node *e = c.node;
+    size_t chunk_chars = e->nexts[0].skip_size - (c.char_pos - c.node_char_pos);
+    size_t chunk_bytes = e->num_bytes - c.offset;
+    if (num_chars < chunk_chars) {
+      chunk_chars = num_chars;
+      chunk_bytes = count_bytes_in_utf8(&e->str[c.offset], num_chars);
+    }
+    memcpy(p, &e->str[c.offset], chunk_bytes);
+    p += chunk_bytes;
+    num_chars -= chunk_chars;
+    rope_cursor_next_chunk(&c);
+  }
+  return p - dest;
+}
+
+size_t rope_slices(rope *r, size_t pos, size_t num_chars,
+    rope_slice *slices, size_t max_slices) {
+  assert(r);
+  assert(slices || max_slices == 0);
+  rope_cursor c;
+  rope_cursor_at_char(r, &c, pos);
+  num_chars = MIN(num_chars, r->num_chars - c.char_pos);
+
+  size_t num_slices = 0;
+  while (num_chars) {
+    rope_node *e = c.node;
+    size_t chunk_chars = e->nexts[0].skip_size - (c.char_pos - c.node_char_pos);
+    size_t chunk_bytes = e->num_bytes - c.offset;
+    if (num_chars < chunk_chars) {
+      chunk_chars = num_chars;
+      chunk_bytes = count_bytes_in_utf8(&e->str[c.offset], num_chars);
+    }
+    if (num_slices < max_slices) {
+      slices[num_slices].data = &e->str[c.offset];
+      slices[num_slices].num_bytes = chunk_bytes;
+    }
+    num_slices++;
+    num_chars -= chunk_chars;
+    rope_cursor_next_chunk(&c);
+  }
+  return num_slices;
+}
+
+struct rope_view_t {
+  void (*free)(void *ptr);
+  size_t num_chars;
+  size_t num_bytes;
+
+  // The text, in order. Each slice points into a large node's buffer (which the view holds a
+  // reference to), into a borrowed buffer, or into the copy of small nodes' text at the end.
+  size_t num_slices;
+  rope_slice *slices;
+  // The number of characters before each slice, and num_chars at the end.
+  size_t *slice_chars;
+  // The large nodes' buffers the view holds references to.
+  size_t num_shared;
+  uint8_t **shared;
+};
+
+rope_view *rope_snapshot(rope *r) {
+  assert(r);
+  size_t num_slices = 0, num_shared = 0, copied_bytes = 0;
+  for (rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
+    if (n->num_bytes == 0) continue;
+    num_slices++;
+    if (n->capacity > ROPE_NODE_STR_SIZE) num_shared++;
+    else if (n->capacity) copied_bytes += n->num_bytes;
+  }
+
+  // Everything goes in one allocation, so it can be freed from any thread in one go.
+  size_t size = sizeof(rope_view) + num_slices * sizeof(rope_slice)
+      + (num_slices + 1) * sizeof(size_t) + num_shared * sizeof(uint8_t *) + copied_bytes;
+  rope_view *v = (rope_view *)r->alloc(size);
+  v->free = r->free;
+  v->num_chars = r->num_chars;
+  v->num_bytes = r->num_bytes;
+  v->num_slices = num_slices;
+  v->slices = (rope_slice *)&v[1];
+  v->slice_chars = (size_t *)&v->slices[num_slices];
+  v->num_shared = num_shared;
+  v->shared = (uint8_t **)&v->slice_chars[num_slices + 1];
+  uint8_t *copy = (uint8_t *)&v->shared[num_shared];
+
+  size_t i = 0, j = 0, char_pos = 0;
+  for (rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
+    if (n->num_bytes == 0) continue;
+    if (n->capacity > ROPE_NODE_STR_SIZE) {
+      // Shared. Writing to it from now on makes the rope copy it first.
+      __atomic_add_fetch(large_str_refs(n->str), 1, __ATOMIC_RELAXED);
+      v->shared[j++] = n->str;
+      v->slices[i].data = n->str;
+    } else if (n->capacity) {
+      // Small nodes are edited in place, so their text is copied.
+      memcpy(copy, n->str, n->num_bytes);
+      v->slices[i].data = copy;
+      copy += n->num_bytes;
+    } else {
+      v->slices[i].data = n->str;
+    }
+    v->slices[i].num_bytes = n->num_bytes;
+    v->slice_chars[i++] = char_pos;
+    char_pos += n->nexts[0].skip_size;
+  }
+  v->slice_chars[num_slices] = char_pos;
+  assert(i == num_slices && j == num_shared && char_pos == r->num_chars);
+  return v;
+}
+
+void rope_view_free(rope_view *v) {
+  if (v == NULL) return;
+  for (size_t i = 0; i < v->num_shared; i++) release_large_str(v->free, v->shared[i]);
+  v->free(v);
+}
+
+size_t rope_view_char_count(const rope_view *v) {
+  assert(v);
+  return v->num_chars;
+}
+
+size_t rope_view_byte_count(const rope_view *v) {
+  assert(v);
+  return v->num_bytes;
+}
+
+const rope_slice *rope_view_slices(const rope_view *v, size_t *num_slices) {
+  assert(v && num_slices);
+  *num_slices = v->num_slices;
+  return v->slices;
+}
+
+size_t rope_view_copy_range(const rope_view *v, size_t pos, size_t num_chars, uint8_t *dest) {
+  assert(v);
+  pos = MIN(pos, v->num_chars);
+  num_chars = MIN(num_chars, v->num_chars - pos);
+
+  // Find the last slice starting at or before pos.
+  size_t lo = 0, hi = v->num_slices;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (v->slice_chars[mid] <= pos) lo = mid;
+    else hi = mid;
+  }
+
+  uint8_t *p = dest;
+  for (size_t i = lo; num_chars && i < v->num_slices; i++) {
+    const uint8_t *str = v->slices[i].data;
+    size_t num_bytes = v->slices[i].num_bytes;
+    size_t skip = pos - v->slice_chars[i];
+    if (skip) {
+      size_t skip_bytes = count_bytes_in_utf8(str, skip);
+      str += skip_bytes;
+      num_bytes -= skip_bytes;
+    }
+    size_t chunk_chars = v->slice_chars[i + 1] - pos;
+    if (num_chars < chunk_chars) {
+      chunk_chars = num_chars;
+      num_bytes = count_bytes_in_utf8(str, num_chars);
+    }
+    memcpy(p, str, num_bytes);
+    p += num_bytes;
+    pos += chunk_chars;
+    num_chars -= chunk_chars;
+  }
+  return p - dest;
+}
+
+#if ROPE_WCHAR
+size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *char_len_out) {
   assert(r);
   size_t wchar_total = rope_wchar_count(r);
   wchar_pos = MIN(wchar_pos, wchar_total);
@@ -785,14 +2907,12 @@ size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *ch
 
   rope_iter end_iter;
   int h = r->head.height - 1;
-  iter_at_wchar_pos(r, iter.s[h].wchar_size + wchar_num, &end_iter);
+  iter_at_wchar_pos(r, wchar_pos + wchar_num, &end_iter);
 
   size_t char_length = end_iter.s[h].skip_size - iter.s[h].skip_size;
   rope_del_at_iter(r, start, &iter, char_length);
 
-#ifdef DEBUG
-  _rope_check(r);
-#endif
+  check_edit(r, char_pos);
   if (char_len_out) {
     *char_len_out = char_length;
   }
@@ -800,6 +2920,72 @@ size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *ch
 }
 #endif
 
+// Check the nodes a search for char_pos passes through. Each node the search goes down from
+// must span exactly what the nodes one level down add up to across the same range, and the
+// node it ends in must hold what its sizes say. This touches O(log n) nodes.
+void _rope_check_path(rope *r, size_t char_pos) {
+  int height = r->head.height - 1;
+  assert(char_pos <= r->num_chars);
+  assert(r->head.nexts[height].node == NULL);
+  assert(r->head.nexts[height].skip_size == r->num_chars);
+  assert(r->head.nexts[height].byte_size == r->num_bytes);
+
+  rope_node *e = &r->head;
+  size_t offset = char_pos;
+  while (true) {
+    rope_skip_node *skip = &e->nexts[height];
+    if (offset > skip->skip_size) {
+      // Go right.
+      offset -= skip->skip_size;
+      e = skip->node;
+      assert(e && e->height > height);
+      continue;
+    }
+    if (height == 0) break;
+
+    // Go down, adding up the next level across the same span as we do.
+    size_t num_chars = 0, num_bytes = 0, num_lines = 0;
+#if ROPE_WCHAR
+    // wchar counts can only be checked where they and everything under them are known.
+    size_t num_wchars = 0;
+#endif
+    for (rope_node *n = e; n != skip->node; n = n->nexts[height - 1].node) {
+      assert(n);
+      num_chars += n->nexts[height - 1].skip_size;
+      num_bytes += n->nexts[height - 1].byte_size;
+      num_lines += n->nexts[height - 1].line_size;
+#if ROPE_WCHAR
+      if (num_wchars != WCHARS_UNKNOWN && n->nexts[height - 1].wchar_size != WCHARS_UNKNOWN) {
+        num_wchars += n->nexts[height - 1].wchar_size;
+      } else {
+        num_wchars = WCHARS_UNKNOWN;
+      }
+#endif
+    }
+    assert(num_chars == skip->skip_size);
+    assert(num_bytes == skip->byte_size);
+    assert(num_lines == skip->line_size);
+#if ROPE_WCHAR
+    assert(num_wchars == WCHARS_UNKNOWN || skip->wchar_size == WCHARS_UNKNOWN
+        || num_wchars == skip->wchar_size);
+#endif
+    height--;
+  }
+
+  assert(e == &r->head || e->num_bytes);
+  assert(e->nexts[0].byte_size == e->num_bytes);
+  utf8_counts counts;
+  bool valid = scan_utf8(e->str, e->num_bytes, &counts);
+  assert(valid);
+  (void)valid;
+  assert(counts.num_chars == e->nexts[0].skip_size);
+  assert(counts.num_lines == e->nexts[0].line_size);
+#if ROPE_WCHAR
+  assert(e->nexts[0].wchar_size == WCHARS_UNKNOWN
+      || count_wchars(e->str, e->num_bytes, counts.num_chars) == e->nexts[0].wchar_size);
+#endif
+}
+
 void _rope_check(rope *r) {
   assert(r->head.height); // Even empty ropes have a height of 1.
   assert(r->num_bytes >= r->num_chars);
@@ -810,8 +2996,12 @@ void _rope_check(rope *r) {
 
   size_t num_bytes = 0;
   size_t num_chars = 0;
+  size_t num_lines = 0;
 #if ROPE_WCHAR
+  // wchar counts which aren't known yet can't be checked. The rest are checked against the text:
+  // iter.s[i].wchar_size holds the rope's wchar count up to the start of wchars_from[i].
   size_t num_wchar = 0;
+  rope_node *wchars_from[ROPE_MAX_HEIGHT];
 #endif
 
   // The offsets here are used to store the total distance travelled from the start
@@ -821,43 +3011,106 @@ void _rope_check(rope *r) {
     iter.s[i].node = &r->head;
   }
 
+#if ROPE_FINGER
+  // Every node in the finger must still be in the rope, at the position the finger remembers.
+  int finger_found = 0;
+#endif
+#if ROPE_COLUMNS
+  // The last node reached at each level, and the column summary of the nodes since.
+  rope_node *cols_from[ROPE_MAX_HEIGHT];
+  rope_skip_node cols[ROPE_MAX_HEIGHT];
+#endif
+
   for (rope_node *n = &r->head; n != NULL; n = n->nexts[0].node) {
     assert(n == &r->head || n->num_bytes);
     assert(n->height <= ROPE_MAX_HEIGHT);
+    assert(n->capacity == 0 || n->num_bytes <= n->capacity);
+    assert(n == &r->head || n->capacity != ROPE_NODE_STR_SIZE
+        || n->str == (uint8_t *)&n->nexts[n->height]);
+#if ROPE_FINGER
+    for (int i = 0; i < r->finger_height; i++) {
+      if (r->finger[i].node != n) continue;
+      assert(i < n->height);
+      assert(r->finger[i].skip_size == num_chars);
+      assert(r->finger[i].byte_size == num_bytes);
+      assert(r->finger[i].line_size == num_lines);
+      finger_found++;
+    }
+#endif
     assert(count_bytes_in_utf8(n->str, n->nexts[0].skip_size) == n->num_bytes);
+    assert(n->nexts[0].byte_size == n->num_bytes);
+    assert(count_newlines(n->str, n->num_bytes) == n->nexts[0].line_size);
 #if ROPE_WCHAR
-    assert(count_wchars_in_utf8(n->str, n->nexts[0].skip_size) == n->nexts[0].wchar_size);
+    for (int i = 0; i < n->height; i++) {
+      if (n != &r->head) {
+        assert(wchars_from[i]->nexts[i].wchar_size == WCHARS_UNKNOWN
+            || wchars_from[i]->nexts[i].wchar_size == num_wchar - iter.s[i].wchar_size);
+      }
+      wchars_from[i] = n;
+      iter.s[i].wchar_size = num_wchar;
+    }
+#endif
+#if ROPE_COLUMNS
+    rope_skip_node node_cols;
+    columns_of(&node_cols, n->str, n->num_bytes);
+    assert(node_cols.cols.lead == n->nexts[0].cols.lead);
+    assert(node_cols.cols.rest == n->nexts[0].cols.rest);
+    for (int i = 0; i < r->head.height; i++) {
+      if (i < n->height) {
+        if (n != &r->head) {
+          assert(cols[i].cols.lead == cols_from[i]->nexts[i].cols.lead);
+          assert(cols[i].cols.rest == cols_from[i]->nexts[i].cols.rest);
+        }
+        cols_from[i] = n;
+        cols[i] = (rope_skip_node){.cols = {0, NO_STOP}};
+      }
+      columns_append(&cols[i], &n->nexts[0]);
+    }
 #endif
     for (int i = 0; i < n->height; i++) {
       assert(iter.s[i].node == n);
       assert(iter.s[i].skip_size == num_chars);
+      assert(iter.s[i].byte_size == num_bytes);
+      assert(iter.s[i].line_size == num_lines);
       iter.s[i].node = n->nexts[i].node;
       iter.s[i].skip_size += n->nexts[i].skip_size;
-#if ROPE_WCHAR
-      assert(iter.s[i].wchar_size == num_wchar);
-      iter.s[i].wchar_size += n->nexts[i].wchar_size;
-#endif
+      iter.s[i].byte_size += n->nexts[i].byte_size;
+      iter.s[i].line_size += n->nexts[i].line_size;
     }
 
     num_bytes += n->num_bytes;
     num_chars += n->nexts[0].skip_size;
+    num_lines += n->nexts[0].line_size;
 #if ROPE_WCHAR
-    num_wchar += n->nexts[0].wchar_size;
+    num_wchar += count_wchars(n->str, n->num_bytes, n->nexts[0].skip_size);
 #endif
   }
 
   for (int i = 0; i < r->head.height; i++) {
     assert(iter.s[i].node == NULL);
     assert(iter.s[i].skip_size == num_chars);
+    assert(iter.s[i].byte_size == num_bytes);
+    assert(iter.s[i].line_size == num_lines);
 #if ROPE_WCHAR
-    assert(iter.s[i].wchar_size == num_wchar);
+    assert(wchars_from[i]->nexts[i].wchar_size == WCHARS_UNKNOWN
+        || wchars_from[i]->nexts[i].wchar_size == num_wchar - iter.s[i].wchar_size);
 #endif
   }
 
   assert(r->num_bytes == num_bytes);
   assert(r->num_chars == num_chars);
 #if ROPE_WCHAR
-  assert(skip_over.wchar_size == num_wchar);
+  (void)wchars_from;
+#endif
+#if ROPE_COLUMNS
+  for (int i = 0; i < r->head.height; i++) {
+    assert(cols[i].cols.lead == cols_from[i]->nexts[i].cols.lead);
+    assert(cols[i].cols.rest == cols_from[i]->nexts[i].cols.rest);
+  }
+  (void)cols_from;
+#endif
+#if ROPE_FINGER
+  assert(finger_found == r->finger_height);
 #endif
 }
 
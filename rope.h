@@ -6,7 +6,11 @@
  * It uses skip lists instead of trees. Trees might be faster - who knows?
  *
  * Ropes are not syncronized. Do not access the same rope from multiple threads
- * simultaneously.
+ * simultaneously. To read a rope's contents on another thread while it is
+ * being edited, take a snapshot with rope_snapshot. Ropes made by
+ * rope_split_at, or joined by rope_concat, share their node pool with the
+ * ropes they came from, so they all count as the same rope here (see
+ * rope_split_at).
  */
 
 #ifndef librope_rope_h
@@ -20,27 +24,52 @@
 // JS, Objective-C and many other languages. See
 // http://josephg.com/post/31707645955/string-length-lies
 //
-// Adding wchar conversion support decreases performance by about 30%.
+// wchar counts are worked out lazily. Edits only mark the counts over the
+// text they touch as unknown, and the wchar functions below count whatever
+// they find unknown and keep the result. So the cost lands on the first wchar
+// query after a run of edits, which recounts the nodes edited since, and
+// apart from slightly bigger skip list entries nothing else pays for it.
 #ifndef ROPE_WCHAR
 #define ROPE_WCHAR 0
 #endif
 
+// Whether or not the rope should keep track of display columns, so an editor
+// can map between characters and screen columns on a line in O(log n) instead
+// of rescanning the line from the start. Tabs go to the next multiple of
+// ROPE_TAB_STOP, East Asian wide characters take 2 columns and combining marks
+// take none. Every edit rescans the nodes it touched and refolds the summaries
+// above them, which makes typing about 5 times slower.
+#ifndef ROPE_COLUMNS
+#define ROPE_COLUMNS 0
+#endif
+
+// Matches shado's TAB_STOP.
+#ifndef ROPE_TAB_STOP
+#define ROPE_TAB_STOP 4
+#endif
+
 /* Ref counter integration */
 #ifndef REF_COUNT
 #define REF_COUNT 1
 #endif
 
-// These two magic values seem to be approximately optimal given the benchmark
-// in tests.c which does lots of small inserts.
+// These two magic values seem to be approximately optimal given the benchmarks
+// in bench.c which do lots of small inserts.
 
 // Must be <= UINT16_MAX. Benchmarking says this is pretty close to optimal
 // (tested on a mac using clang 4.0 and x86_64).
 #ifndef ROPE_NODE_STR_SIZE
-#if ROPE_WCHAR
-#define ROPE_NODE_STR_SIZE 64
-#else
 #define ROPE_NODE_STR_SIZE 136
 #endif
+
+// Text which arrives in bulk (rope_new_from_buffer, or inserting a long
+// string) is stored in nodes with room for this many bytes instead, so a big
+// file doesn't need a node (and its skip pointers) for every 136 bytes. Text
+// typed into the middle of a large node goes into small nodes of its own.
+// Must be <= UINT16_MAX. Setting this to ROPE_NODE_STR_SIZE turns large nodes
+// off.
+#ifndef ROPE_LARGE_NODE_STR_SIZE
+#define ROPE_LARGE_NODE_STR_SIZE 4096
 #endif
 
 // The likelyhood (%) a node will have height (n+1) instead of n
@@ -48,12 +77,70 @@
 #define ROPE_BIAS 25
 #endif
 
+// The seed each new rope's random number generator starts with. Node heights
+// are random, so ropes built by the same sequence of edits only have the same
+// layout if they start from the same seed. See also rope_set_seed.
+#ifndef ROPE_DEFAULT_SEED
+#define ROPE_DEFAULT_SEED 0x2545f4914f6cdd1dULL
+#endif
+
 // The rope will stop being efficient after the string is 2 ^ ROPE_MAX_HEIGHT
 // nodes.
 #ifndef ROPE_MAX_HEIGHT
 #define ROPE_MAX_HEIGHT 60
 #endif
 
+// Whether to use SSE2 / AVX2 (picked at runtime) to validate and count utf8.
+// Only has an effect on x86 with gcc or clang.
+#ifndef ROPE_SIMD
+#define ROPE_SIMD 1
+#endif
+
+// Whether nodes are carved out of per-rope slabs (one size class per node
+// height) instead of being allocated one at a time.
+#ifndef ROPE_POOL
+#define ROPE_POOL 1
+#endif
+
+// The largest slab the pool will ask the allocator for. Slabs start at a few
+// nodes and double from there, so rarely used heights stay cheap.
+#ifndef ROPE_POOL_SLAB_BYTES
+#define ROPE_POOL_SLAB_BYTES 65536
+#endif
+
+// Nodes unlinked by rope_del are kept aside and reused by later inserts. This
+// is the most nodes of any one height which will be kept around; past that
+// they go back to the allocator.
+#ifndef ROPE_RECYCLE_MAX
+#define ROPE_RECYCLE_MAX 64
+#endif
+
+// Whether the rope remembers where the last search ended (a "finger") and
+// starts the next search from there. Consecutive edits usually land close
+// together, and nearby positions can be found without going back to the head.
+#ifndef ROPE_FINGER
+#define ROPE_FINGER 1
+#endif
+
+// How much the rope checks itself after every edit:
+// 0: Not at all.
+// 1: Check the O(log n) nodes on the path to the edit (see _rope_check_path).
+// 2: As well as that, run the full O(n) _rope_check every ROPE_CHECK_EVERY
+//    edits. Setting the ROPE_CHECK_EVERY environment variable overrides this
+//    at runtime: 1 checks everything on every edit and 0 never does.
+// Defaults to 2 when DEBUG is defined, and 0 otherwise.
+#ifndef ROPE_CHECK_LEVEL
+#ifdef DEBUG
+#define ROPE_CHECK_LEVEL 2
+#else
+#define ROPE_CHECK_LEVEL 0
+#endif
+#endif
+
+#ifndef ROPE_CHECK_EVERY
+#define ROPE_CHECK_EVERY 1000
+#endif
+
 struct rope_node_t;
 
 // The number of characters in str can be read out of nexts[0].skip_size.
@@ -66,17 +153,45 @@ typedef struct {
   // exactly _here_ in the struct.
   struct rope_node_t *node;
 
+  // The number of bytes between the start of the current node and the start
+  // of next.
+  size_t byte_size;
+
+  // The number of '\n' characters between the start of the current node and
+  // the start of next.
+  size_t line_size;
+
 #if ROPE_WCHAR
-  // The number of wide characters contained in space.
+  // The number of wide characters contained in space, or SIZE_MAX if that
+  // hasn't been counted since the last edit here.
   size_t wchar_size;
 #endif
+
+#if ROPE_COLUMNS
+  // How the text between the start of the current node and the start of next
+  // moves the display column. lead is the number of columns before the first
+  // tab or newline. If there's a newline, rest is the column the text ends on.
+  // Otherwise if there's a tab, rest counts columns on from the tab stop the
+  // first tab goes to. If there's neither, rest is SIZE_MAX.
+  struct {
+    size_t lead;
+    size_t rest;
+  } cols;
+#endif
 } rope_skip_node;
 
 typedef struct rope_node_t {
-  uint8_t str[ROPE_NODE_STR_SIZE];
+  // The node's text. Small nodes keep it just past the end of nexts, in the
+  // same allocation. Large nodes keep it in an allocation of its own.
+  uint8_t *str;
 
   // The number of bytes in str in use
   uint16_t num_bytes;
+
+  // The number of bytes str has room for. Either ROPE_NODE_STR_SIZE or
+  // ROPE_LARGE_NODE_STR_SIZE, or 0 if str is borrowed from the buffer passed
+  // to rope_new_from_mapped (and must not be written to).
+  uint16_t capacity;
   
   // This is the number of elements allocated in nexts.
   // Each height is 1/2 as likely as the height before. The minimum height is 1.
@@ -88,6 +203,10 @@ typedef struct rope_node_t {
   rope_skip_node nexts[];
 } rope_node;
 
+#if ROPE_POOL
+struct rope_pool_t;
+#endif
+
 typedef struct {
   // The total number of characters in the rope.
   size_t num_chars;
@@ -99,6 +218,38 @@ typedef struct {
   void *(*realloc)(void *ptr, size_t newsize);
   void (*free)(void *ptr);
 
+  // State for the random number generator used to pick node heights. Each
+  // rope has its own, so ropes on different threads don't share anything.
+  uint64_t rng_state;
+
+#if ROPE_CHECK_LEVEL >= 2
+  // Edits since the last full check.
+  size_t num_unchecked_edits;
+#endif
+
+#if ROPE_POOL
+  // The slabs this rope's nodes are carved out of. Ropes which have been
+  // split apart or joined together share a pool, since their nodes are mixed
+  // up in the same slabs.
+  struct rope_pool_t *pool;
+#endif
+
+  // Deleted nodes waiting to be reused, chained through nexts[0].node.
+  // Indexed by node height - 1.
+  struct rope_node_t *recycled[ROPE_MAX_HEIGHT];
+  uint16_t num_recycled[ROPE_MAX_HEIGHT];
+
+  // The character position rope_compact will carry on from.
+  size_t compact_pos;
+
+#if ROPE_FINGER
+  // The nodes the last character search passed through at each height. Unlike
+  // the skip list, the sizes here are measured from the start of the rope to
+  // the start of each node. finger_height is 0 when the finger isn't valid.
+  rope_skip_node finger[ROPE_MAX_HEIGHT];
+  uint8_t finger_height;
+#endif
+
   // The first node exists inline in the rope structure itself.
   #pragma GCC diagnostic ignored "-Wpedantic"
   rope_node head;
@@ -111,21 +262,49 @@ extern "C" {
 #if REF_COUNT
 /* Reference Counter methods */
 void ref_inc (rope_node *n);
-void ref_dec (rope_node *n);
+// Returns the number of references left. Nodes are owned by their rope, so
+// the rope frees a node once it has been unlinked and this reaches 0.
+int ref_dec (rope_node *n);
 #endif
 
 // Create a new rope with no contents
 rope *rope_new();
 
-// Create a new rope using custom allocators.
+// Create a new rope using custom allocators. When ROPE_POOL is set the
+// allocator is used for whole slabs of nodes rather than for single nodes.
 rope *rope_new2(void *(*alloc)(size_t bytes),
     void *(*realloc)(void *ptr, size_t newsize),
     void (*free)(void *ptr));
 
+// Reseed the random number generator which picks node heights. New ropes are
+// seeded with ROPE_DEFAULT_SEED, and copies carry on from the original's
+// state.
+void rope_set_seed(rope *r, uint64_t seed);
+
 // Create a new rope containing a copy of the given string. Shorthand for
 // r = rope_new(); rope_insert(r, 0, str);
 rope *rope_new_with_utf8(const uint8_t *str);
 
+// Like rope_new_with_utf8, but takes the length of str instead of looking for
+// a '\0'. Shorthand for rope_new_from_buffer(str, num_bytes).
+rope *rope_new_with_utf8_n(const uint8_t *str, size_t num_bytes);
+
+// Create a new rope containing a copy of the first num_bytes of buf. This is
+// the fast way to load a large document: leaves are packed full and node
+// heights are assigned deterministically, so the whole skip list is built in a
+// single linear pass. Returns NULL if buf isn't valid utf8.
+rope *rope_new_from_buffer(const uint8_t *buf, size_t num_bytes);
+
+// Like rope_new_from_buffer, but the nodes point into buf instead of holding
+// copies of it, in the style of a piece table. This is meant for a file mapped
+// read-only: nothing is copied out of the mapping until that part of it is
+// edited, and new text goes into nodes of its own. Loading still reads all of
+// buf once, to validate it and count characters and lines.
+//
+// buf must not change, and must outlive the rope and any rope copied or split
+// from it.
+rope *rope_new_from_mapped(const uint8_t *buf, size_t num_bytes);
+
 // Make a copy of an existing rope
 rope *rope_copy(const rope *r);
 
@@ -149,6 +328,53 @@ size_t rope_write_cstr(rope *r, uint8_t *dest);
 // Use rope_byte_count(r) to get the length of the returned string.
 uint8_t *rope_create_cstr(rope *r);
 
+// Copy the num_chars characters starting at pos into dest. Doesn't add a
+// trailing '\0'. The range is clamped to the end of the rope. Returns the
+// number of bytes written, which is at most
+// rope_char_to_byte(r, pos + num_chars) - rope_char_to_byte(r, pos).
+size_t rope_copy_range(rope *r, size_t pos, size_t num_chars, uint8_t *dest);
+
+// A run of bytes inside a rope node. This is laid out the same way as struct
+// iovec, so an array of slices can be handed straight to writev().
+typedef struct {
+  const uint8_t *data;
+  size_t num_bytes;
+} rope_slice;
+
+// Find the num_chars characters starting at pos without copying them. Fills
+// in up to max_slices slices which together hold the range, in order, and
+// returns the number of slices the whole range needs. (If that's more than
+// max_slices, only the start of the range was filled in.) The slices point
+// into the rope, so they're only good until it's next changed.
+size_t rope_slices(rope *r, size_t pos, size_t num_chars,
+    rope_slice *slices, size_t max_slices);
+
+// A read-only copy of a rope's contents at some moment, which can be read on
+// any thread while the rope goes on being edited.
+typedef struct rope_view_t rope_view;
+
+// Take a snapshot of r. This doesn't copy the text of large or borrowed nodes:
+// the view holds a reference to each large node's buffer instead, and the
+// rope copies a buffer before changing it while a view still refers to it.
+// Small nodes' text is copied. Costs O(nodes + bytes in small nodes).
+//
+// Views are independent of the rope, and each other. Any thread can read a
+// view, and free it once it's done. (So the rope's allocator must be thread
+// safe.) The rope can be freed first, but a buffer passed to
+// rope_new_from_mapped must outlive views of the rope too.
+rope_view *rope_snapshot(rope *r);
+void rope_view_free(rope_view *v);
+
+size_t rope_view_char_count(const rope_view *v);
+size_t rope_view_byte_count(const rope_view *v);
+
+// The view's text as a series of slices, in order.
+const rope_slice *rope_view_slices(const rope_view *v, size_t *num_slices);
+
+// Like rope_copy_range, for a view.
+size_t rope_view_copy_range(const rope_view *v, size_t pos, size_t num_chars,
+    uint8_t *dest);
+
 // If you try to insert data into the rope with an invalid UTF8 encoding,
 // nothing will happen and we'll return ROPE_INVALID_UTF8.
 typedef enum { ROPE_OK, ROPE_INVALID_UTF8 } ROPE_RESULT;
@@ -162,10 +388,221 @@ ROPE_RESULT rope_append(rope *r, const uint8_t *str);
 // Insert the given utf8 string into the rope at the specified position.
 ROPE_RESULT rope_insert(rope *r, size_t pos, const uint8_t *str);
 
+// Length delimited variants of the above, for data which isn't '\0'
+// terminated (like a buffer from read() or a mmap'd file). The string doesn't
+// need a terminator and may contain '\0' bytes, which are stored as ordinary
+// characters. Note rope_write_cstr will still copy them out, so C string
+// functions will stop short on ropes containing them.
+ROPE_RESULT rope_append_n(rope *r, const uint8_t *str, size_t num_bytes);
+ROPE_RESULT rope_insert_n(rope *r, size_t pos, const uint8_t *str, size_t num_bytes);
+
 // Delete num characters at position pos. Deleting past the end of the string
 // has no effect.
 void rope_del(rope *r, size_t pos, size_t num);
+
+// Cut the rope in two at pos. r keeps the characters before pos, and the rest
+// are moved into a new rope which is returned. Only the nodes either side of
+// the cut are touched, so this is O(log n) no matter how much text moves.
+//
+// The nodes stay where they were allocated, so both halves keep allocating
+// from and freeing into r's node pool, and every edit to either one touches
+// it. Don't use the two halves (or anything concatenated with them) on
+// different threads at the same time. To hand one to another thread, give it
+// a rope_copy, which has a pool of its own, and free the half.
+rope *rope_split_at(rope *r, size_t pos);
+
+// Move the contents of b onto the end of a, and free b. Like rope_split_at
+// this only relinks the nodes at the join. a and b must use the same
+// allocator functions. Joining ropes which didn't come from splitting the
+// same rope also has to merge their node pools, which costs a little extra
+// per slab (not per node). After that, every rope which shared a pool with a
+// or b shares one with both, and the threading rule in rope_split_at applies
+// to all of them.
+void rope_concat(rope *a, rope *b);
+
+// Inserting into the middle of a full node splits it, and deletes leave nodes
+// partly empty, so a rope which has been edited for a while ends up with many
+// more nodes than its contents need. This merges runs of adjacent underfull
+// nodes into as few nodes as will hold them, giving the new nodes fresh
+// heights.
+//
+// Each call looks at no more than max_nodes nodes, and carries on from where
+// the last call stopped, so it can be run a little at a time when the editor
+// is idle. Returns 1 when this call finished a pass over the whole rope (the
+// next call starts another), and 0 otherwise.
+int rope_compact(rope *r, size_t max_nodes);
+
+// The number of bytes stored in the rope's nodes over the number of bytes they
+// have room for, between 0 and 1. Walks every node.
+double rope_fill_ratio(const rope *r);
+
+// How much memory a rope is using, and what shape it's in. Filled in by
+// rope_stats.
+typedef struct {
+  // Nodes in the rope, including the head. Large and borrowed nodes are
+  // counted in num_nodes too.
+  size_t num_nodes;
+  size_t num_large_nodes;
+  size_t num_borrowed_nodes;
+  // Deleted nodes kept around for reuse.
+  size_t num_recycled_nodes;
+
+  // Everything the rope has taken from its allocator, including unused room
+  // in nodes and pool slabs. Ropes split from each other share a pool, so
+  // each of them counts all of it. Borrowed text isn't counted.
+  size_t allocated_bytes;
+  // The rope's text. (rope_byte_count)
+  size_t payload_bytes;
+
+  // Nodes by how full they are: fill_histogram[i] counts nodes between i/10
+  // and (i+1)/10 full. Borrowed nodes count as full.
+  size_t fill_histogram[10];
+  // Nodes by height: height_histogram[i] counts nodes of height i + 1.
+  size_t height_histogram[ROPE_MAX_HEIGHT];
+  uint8_t head_height;
+
+  // The number of skip pointers a search for a character position follows,
+  // averaged over every position in the rope. (Without the finger's help.)
+  double avg_search_path;
+} rope_stats_info;
+
+// Measure r. Walks every node.
+void rope_stats(const rope *r, rope_stats_info *stats);
+
+// One edit in a batch passed to rope_apply_edits: delete num_deleted
+// characters at pos, then insert num_bytes of str there. Either half can be
+// empty.
+typedef struct {
+  // In characters, measured in the rope as it was before any of the batch
+  // was applied.
+  size_t pos;
+  size_t num_deleted;
+
+  // Doesn't need a '\0' terminator. May be NULL if num_bytes is 0.
+  const uint8_t *str;
+  size_t num_bytes;
+} rope_edit;
+
+// Apply a batch of edits (like every replacement in a replace-all, or a
+// keystroke at each of several cursors) in one left to right pass. The edits
+// must be sorted by pos and must not overlap. Edits close together are
+// spliced into a single replacement of up to ROPE_LARGE_NODE_STR_SIZE bytes,
+// so a dense batch costs one search, delete and insert per group rather than
+// per edit.
+//
+// All the inserted strings are checked first. If any of them isn't valid
+// utf8, nothing is changed and ROPE_INVALID_UTF8 is returned.
+ROPE_RESULT rope_apply_edits(rope *r, const rope_edit *edits, size_t num_edits);
+
+// Byte addressed variants of the functions above. Byte positions which land
+// inside a multibyte character are rounded down to the start of that
+// character. All of these are O(log n).
+//
+// Insert the given utf8 string into the rope at the specified byte position.
+ROPE_RESULT rope_insert_at_byte(rope *r, size_t byte_pos, const uint8_t *str);
+
+// Delete num_bytes bytes starting at byte_pos. Both ends are rounded down to a
+// character boundary.
+void rope_del_bytes(rope *r, size_t byte_pos, size_t num_bytes);
+
+// Convert between byte and character positions. Both are clamped to the end
+// of the rope.
+size_t rope_byte_to_char(rope *r, size_t byte_pos);
+size_t rope_char_to_byte(rope *r, size_t char_pos);
+
+// Get the number of lines in the rope. Lines are separated by '\n', so this is
+// always one more than the number of newlines (an empty rope has 1 line, and a
+// trailing newline starts an empty last line).
+size_t rope_line_count(const rope *r);
+
+// Get the character position at which the given (0-based) line starts. Lines
+// past the end of the rope map to rope_char_count(r).
+size_t rope_line_to_char(rope *r, size_t line);
+
+// Get the (0-based) line containing the character at pos. pos is clamped to
+// rope_char_count(r).
+size_t rope_char_to_line(rope *r, size_t pos);
+
+#if ROPE_COLUMNS
+// Get the display column of the character at pos, counting from the start of
+// its line. pos is clamped to rope_char_count(r).
+size_t rope_char_to_column(rope *r, size_t pos);
+
+// Get the position of the character drawn at column on the given (0-based)
+// line. Columns inside a tab or a wide character map to that character, and
+// columns past the end of the line map to the end of the line (its '\n').
+// Lines past the end of the rope map to rope_char_count(r).
+size_t rope_column_to_char(rope *r, size_t line, size_t column);
+
+// The number of columns a character other than '\t' or '\n' takes up, as the
+// rope counts them. Use this to draw the text consistently.
+size_t rope_codepoint_width(int32_t codepoint);
+#endif
   
+// A cursor walks through the rope one character, line or node-sized chunk at
+// a time without copying it out. Seeking is O(log n). Stepping forward is
+// O(1), as is stepping back inside a chunk; stepping back over the start of a
+// chunk searches again from the head.
+//
+// Cursors read the rope's nodes directly, so any change to the rope
+// invalidates every cursor on it. Seek them again after editing.
+//
+// Eg:
+//  rope_cursor c;
+//  rope_cursor_at_line(r, &c, 10);
+//  for (int32_t ch; (ch = rope_cursor_next(&c)) != -1 && ch != '\n';) {
+//    ...
+//  }
+typedef struct {
+  rope *r;
+
+  // The node holding the character after the cursor, and the byte offset of
+  // that character in it. offset only equals node->num_bytes at the end of
+  // the rope.
+  struct rope_node_t *node;
+  size_t offset;
+
+  // The position of the start of node.
+  size_t node_char_pos;
+  size_t node_line_pos;
+
+  // The cursor's position. These are read only.
+  size_t char_pos;
+  size_t byte_pos;
+  size_t line_pos;
+} rope_cursor;
+
+// Seek to a character position, byte position (rounded down to the start of
+// a character), or the start of a (0-based) line. Positions past the end of
+// the rope are clamped to the end.
+void rope_cursor_at_char(rope *r, rope_cursor *c, size_t char_pos);
+void rope_cursor_at_byte(rope *r, rope_cursor *c, size_t byte_pos);
+void rope_cursor_at_line(rope *r, rope_cursor *c, size_t line);
+
+// Get the codepoint after the cursor without moving it. Returns -1 at the end
+// of the rope.
+int32_t rope_cursor_peek(const rope_cursor *c);
+
+// Step over the codepoint after / before the cursor and return it. Return -1
+// (and don't move) at the end / start of the rope.
+int32_t rope_cursor_next(rope_cursor *c);
+int32_t rope_cursor_prev(rope_cursor *c);
+
+// Move to the start of the next / previous line. Returns 0 (and doesn't move)
+// if the cursor is already on the last / first line.
+int rope_cursor_next_line(rope_cursor *c);
+int rope_cursor_prev_line(rope_cursor *c);
+
+// Get the run of bytes from the cursor to the end of its node. *num_bytes is
+// set to its length, which is only 0 at the end of the rope.
+const uint8_t *rope_cursor_chunk(const rope_cursor *c, size_t *num_bytes);
+
+// Move to the start of the next chunk, or the start of the previous chunk (or
+// of the current one, if the cursor is inside it). Returns 0 (and doesn't
+// move) at the end / start of the rope.
+int rope_cursor_next_chunk(rope_cursor *c);
+int rope_cursor_prev_chunk(rope_cursor *c);
+
 // This macro expands to a for() loop header which loops over the segments in a
 // rope.
 //
@@ -192,6 +629,11 @@ static inline size_t rope_node_num_bytes(rope_node *n) {
 static inline size_t rope_node_chars(rope_node *n) {
   return n->nexts[0].skip_size;
 }
+
+// Get the number of newlines inside a rope node.
+static inline size_t rope_node_lines(rope_node *n) {
+  return n->nexts[0].line_size;
+}
   
 #if ROPE_WCHAR
 // Get the number of wchar characters in the rope
@@ -212,18 +654,31 @@ size_t rope_insert_at_wchar(rope *r, size_t wchar_pos, const uint8_t *utf8_str);
 size_t rope_del_at_wchar(rope *r, size_t wchar_pos, size_t wchar_num, size_t *char_len_out);
   
 // Get the number of wchars inside a rope node. This is useful when you're
-// looping throuhg a rope.
-static inline size_t rope_node_wchars(rope_node *n) {
-  return n->nexts[0].wchar_size;
-}
+// looping throuhg a rope. (Counts it first if it isn't known.)
+size_t rope_node_wchars(rope_node *n);
 #endif
 
 
   
-// For debugging.
+// For debugging. _rope_check checks the whole rope, and _rope_check_path just
+// the nodes a search for char_pos passes through.
 void _rope_check(rope *r);
+void _rope_check_path(rope *r, size_t char_pos);
 void _rope_print(rope *r);
 
+// For benchmarking. Force the kernel used to validate and count utf8. Returns
+// the kernel actually in use, which falls back to the best one the CPU
+// supports.
+typedef enum {
+  ROPE_KERNEL_AUTO, ROPE_KERNEL_SCALAR, ROPE_KERNEL_SSE2, ROPE_KERNEL_AVX2
+} ROPE_KERNEL;
+ROPE_KERNEL _rope_set_kernel(ROPE_KERNEL kernel);
+
+// Validate the first num_bytes of str with the current kernel. Returns the
+// number of characters (and newlines, if num_lines isn't NULL), or SIZE_MAX if
+// str isn't valid utf8.
+size_t _rope_scan_utf8(const uint8_t *str, size_t num_bytes, size_t *num_lines);
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,6 +8,7 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,6 +16,8 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -22,6 +25,10 @@
 #define page_size sysconf(_SC_PAGESIZE)
 #define ceil_page(x) (x + page_size-1) & ~(page_size-1)
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /* #define container_of(ptr, type, member) \ */
 /*     ((type *)((char *)(ptr) - offsetof(type, member))) */
 /* }}} */
@@ -47,6 +54,7 @@ struct Cursor {
 
 typedef struct Block {
     const uint8_t *src;
+    size_t len;
     int count;
 } Block;
 
@@ -67,6 +75,9 @@ struct GlobalState {
 
     int print_flag; /* Makes sure not to print escape code keys */
 
+    char stsmsg[80];
+    time_t stsmsg_time;
+
     Block* blk;
 };
 
@@ -107,6 +118,7 @@ enum char_type {
 struct GlobalState E;
 /*  Term {{{ */
 void quit ();
+int exec_cmd (const char *cmd);
 
 void kill (const char *s) {
     write(STDOUT_FILENO, "\x1b[2J", 4);
@@ -181,8 +193,9 @@ void quit () {
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
     disable_raw();
-    _rope_print(E.rope_head);
     rope_free(E.rope_head);
+    /* the rope borrows from the mapping, so it goes first */
+    if (E.blk && E.blk[0].len) munmap((void*)E.blk[0].src, E.blk[0].len);
     /* printf("\nE.row[i].render: %s\n", E.row[0].render); */
     /* printf("E.row[i].size: %d\n", E.row[0].size); */
     /* printf("E.screenrows: %d\nE.screencols: %d\n", E.screenrows, E.screencols); */
@@ -191,6 +204,15 @@ void quit () {
     exit(0);
 }
 /* }}} */
+/* -- Bar -- {{{ */
+void set_sts_msg (const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.stsmsg, sizeof(E.stsmsg), fmt, ap);
+    va_end(ap);
+    E.stsmsg_time = time(NULL);
+}
+/* }}} */
 /* -- Memory Operations -- {{{ */
 /* }}} */
 void free_row (erow *row) {
@@ -227,7 +249,69 @@ void insert_row (int at, char *s, size_t len) {
     E.dirty++;
 }
 
-void save_file (int fd) {
+/* writev all of iov, picking up after short writes. returns -1 on error */
+int write_iov (int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (cnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/* Write the rope to fd straight out of its nodes, IOV_MAX of them per
+ * writev. Nothing is copied, so saving takes no more memory for a bigger
+ * file. returns -1 on error */
+int write_rope (int fd, rope *r) {
+    struct iovec iov[IOV_MAX];
+    int cnt = 0;
+    ROPE_FOREACH(r, n) {
+        if (rope_node_num_bytes(n) == 0) continue; /* the head can be empty */
+        iov[cnt].iov_base = rope_node_data(n);
+        iov[cnt].iov_len = rope_node_num_bytes(n);
+        if (++cnt == IOV_MAX) {
+            if (write_iov(fd, iov, cnt) == -1) return -1;
+            cnt = 0;
+        }
+    }
+    return write_iov(fd, iov, cnt);
+}
+
+/* fsync the directory path is in, so a rename in it is on disk too */
+int sync_dir (const char *path) {
+    char dir[strlen(path) + 2];
+    const char *slash = strrchr(path, '/');
+    if (!slash) strcpy(dir, ".");
+    else if (slash == path) strcpy(dir, "/");
+    else {
+        memcpy(dir, path, slash - path);
+        dir[slash - path] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) return -1;
+    int ret = fsync(fd);
+    close(fd);
+    return ret;
+}
+
+/* Save crash safely. The rope streams into a temp file beside the real one,
+ * which is fsynced and renamed over it, then the directory is fsynced. A
+ * crash at any point leaves the old file or the new one, never half of
+ * each. (The rope still reads from the mapped file, so it couldn't be
+ * written in place anyway; the mapping keeps the old inode alive.)
+ * returns -1 and says why in the status bar if the file wasn't saved */
+int save_file () {
     /* if (E.filename == NULL) { */
     /*     E.filename = prompt_line("Save as: %s (ESC: Cancel)", NULL); */
     /*     if (E.filename == NULL) { */
@@ -235,28 +319,75 @@ void save_file (int fd) {
     /*         return; */
     /*     } */
     /* } */
-
-    uint8_t *buf = rope_create_cstr(E.rope_head);
-    unsigned long len = rope_byte_count(E.rope_head);
-    memcpy((void*)E.blk[0].src, buf, len);
-    if (fd != -1) {
-        if (msync((void*)E.blk[0].src, len, MS_ASYNC) == -1)
-            kill("msync");
-        if (close(fd) == -1) kill("close");
-        /* set_sts_msg("%d bytes written to disk", len); */
-        free(buf);
-        E.dirty = 0;
-
-        return;
+    if (E.filename == NULL) {
+        set_sts_msg("No file name");
+        return -1;
     }
-    free(buf);
-    /* set_sts_msg("Can't save! I/O error: %s", strerror(errno)); */
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* replace what a symlink points to, not the link */
+    char *path = realpath(E.filename, NULL);
+    if (!path) path = strdup(E.filename);
+    char tmp[strlen(path) + 8];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    const char *what = "mkstemp";
+    int ret, tmp_created = 0, fd = mkstemp(tmp);
+    if (fd == -1) goto fail;
+    tmp_created = 1;
+
+    /* keep the old file's owner if we're allowed to, and its permissions.
+     * chown clears the setuid and setgid bits, so it has to go first */
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        what = "fchown";
+        if (fchown(fd, st.st_uid, st.st_gid) == -1 && errno != EPERM) goto fail;
+        what = "fchmod";
+        if (fchmod(fd, st.st_mode & 07777) == -1) goto fail;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        what = "fchmod";
+        if (fchmod(fd, 0666 & ~mask) == -1) goto fail;
+    }
+
+    what = "writev";
+    if (write_rope(fd, E.rope_head) == -1) goto fail;
+    what = "fsync";
+    if (fsync(fd) == -1) goto fail;
+    what = "close";
+    ret = close(fd);
+    fd = -1;
+    if (ret == -1) goto fail;
+    what = "rename";
+    if (rename(tmp, path) == -1) goto fail;
+
+    /* the new file is in place now, whether or not this works */
+    ret = sync_dir(path);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    set_sts_msg("%zu bytes written to disk in %.1fms%s", rope_byte_count(E.rope_head), ms,
+            ret == -1 ? " (directory not synced)" : "");
+    free(path);
+    E.dirty = 0;
+    return 0;
+
+fail:
+    ret = errno;
+    if (fd != -1) close(fd);
+    if (tmp_created) unlink(tmp);
+    set_sts_msg("Can't save! %s: %s", what, strerror(ret));
+    free(path);
+    return -1;
 }
 
-/* MMap page sector of file into blk */
-Block *map_block (Block *blk, int fp, unsigned short page_num) {
-    if (page_num < 1) return NULL;
-    blk->src = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fp, (page_num-1)*page_size);
+/* MMap the whole file into blk, read only. The rope points straight into it */
+Block *map_block (Block *blk, int fp, size_t len) {
+    blk->len = len;
+    blk->count = 0;
+    blk->src = NULL;
+    if (len == 0) return blk; /* can't map an empty file */
+    blk->src = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fp, 0);
     if (blk->src == MAP_FAILED) kill("mmap");
     blk->count++;
     return blk;
@@ -264,23 +395,209 @@ Block *map_block (Block *blk, int fp, unsigned short page_num) {
 
 void open_file (char *filename) {
     int fp;
-    size_t fp_size;
+    off_t fp_size;
     free(E.filename);
     E.filename = strdup(filename);
 
-    fp = open(filename, O_RDWR);
-    if (!fp) kill("fopen");
-    /* fp_size = lseek(fp, 0, SEEK_END); */
-    /* fp_size = ceil_page(fp_size); /1* ceilings to the next page *1/ */
+    fp = open(filename, O_RDONLY);
+    if (fp == -1) kill("open");
+    fp_size = lseek(fp, 0, SEEK_END);
+    if (fp_size == (off_t)-1) kill("lseek");
 
     E.blk = malloc(sizeof(Block));
-    /* map first block of file */
-    if (!map_block(&E.blk[0], fp, 1)) kill("map_block");
-    rope_append(E.rope_head, E.blk[0].src);
-    rope_del(E.rope_head, 0, 8); /* test to see if anything gets updated on save */
-    save_file(fp);
+    if (!map_block(&E.blk[0], fp, fp_size)) kill("map_block");
+    /* the mapping outlives the descriptor */
+    if (close(fp) == -1) kill("close");
+
+    /* nodes reference spans of the mapping, and are only copied when edited */
+    rope_free(E.rope_head);
+    E.rope_head = rope_new_from_mapped(E.blk[0].src, fp_size);
+    if (!E.rope_head) kill("rope_new_from_mapped");
     E.dirty = 0;
 }
+/* -- Execute -- {{{ */
+typedef void (*handle)();
+
+void e_stats ();
+void e_write ();
+
+/* commands typed after ':' */
+const struct mapping_exec {
+    char *cmd;
+    handle cmd_func;
+} e_map[] = {
+    {"stats", e_stats},
+    {"w", e_write},
+    {"q", quit},
+};
+
+/* run the named command. returns 0 if there's no such command */
+int exec_cmd (const char *cmd) {
+    for (int i = 0; i < LEN(e_map); ++i)
+        if (!strcmp(cmd, e_map[i].cmd)) {
+            e_map[i].cmd_func();
+            return 1;
+        }
+    return 0;
+}
+
+/* memory use and shape of the buffer's rope, to catch fragmentation */
+void e_stats () {
+    rope_stats_info st;
+    rope_stats(E.rope_head, &st);
+    set_sts_msg("%zu nodes (%zu mapped) %.1f/%.1fM fill %.0f%% h%d path %.1f",
+            st.num_nodes, st.num_borrowed_nodes,
+            st.payload_bytes / 1048576.0, st.allocated_bytes / 1048576.0,
+            100 * rope_fill_ratio(E.rope_head), st.head_height,
+            st.avg_search_path);
+}
+
+void e_write () {
+    save_file(); /* says how it went in the status bar */
+}
+/* }}} */
+/* -- Output -- {{{ */
+void ab_append (struct abuf *ab, const char *s, int len) {
+    char *new = realloc(ab->b, ab->len + len);
+    if (new == NULL) return;
+    memcpy(&new[ab->len], s, len);
+    ab->b = new;
+    ab->len += len;
+}
+
+void ab_free (struct abuf *ab) {
+    free(ab->b);
+}
+
+/* lines of the rope from rowoff down, tabs expanded and cut at the screen edge */
+void draw_rows (struct abuf *ab) {
+    size_t numlines = rope_line_count(E.rope_head);
+    for (int y = 0; y < E.screenrows; y++) {
+        size_t line = E.curs.rowoff + y;
+        if (line >= numlines) {
+            ab_append(ab, "~", 1);
+        } else {
+            size_t start = rope_line_to_char(E.rope_head, line);
+            size_t end = rope_line_to_char(E.rope_head, line + 1);
+            size_t len = end - start;
+            if (len > (size_t)E.screencols) len = E.screencols;
+            /* characters can be any length, so ask the rope how many bytes they take */
+            size_t start_byte = rope_char_to_byte(E.rope_head, start);
+            uint8_t *buf = malloc(rope_char_to_byte(E.rope_head, start + len) - start_byte + 1);
+            if (buf == NULL) kill("malloc");
+            len = rope_copy_range(E.rope_head, start, len, buf);
+            int col = 0;
+            for (size_t j = 0; j < len && col < E.screencols; j++) {
+                if (buf[j] == '\n') break;
+                if (buf[j] == '\t') {
+                    do ab_append(ab, " ", 1);
+                    while (++col % TAB_STOP != 0 && col < E.screencols);
+                    continue;
+                }
+                ab_append(ab, (char*)&buf[j], 1);
+                if ((buf[j] & 0xc0) != 0x80) col++;
+            }
+            free(buf);
+        }
+        ab_append(ab, "\x1b[K\r\n", 5);
+    }
+}
+
+void draw_status_bar (struct abuf *ab) {
+    char status[80];
+    ab_append(ab, "\x1b[7m", 4);
+    int len = snprintf(status, sizeof(status), "%.20s - %zu lines %s",
+            E.filename ? E.filename : "[No Name]", rope_line_count(E.rope_head),
+            E.dirty ? "(modified)" : "");
+    if (len > E.screencols) len = E.screencols;
+    ab_append(ab, status, len);
+    for (; len < E.screencols; len++) ab_append(ab, " ", 1);
+    ab_append(ab, "\x1b[m\r\n", 5);
+}
+
+/* the last set_sts_msg, for 5 seconds */
+void draw_msg_bar (struct abuf *ab) {
+    ab_append(ab, "\x1b[K", 3);
+    if (time(NULL) - E.stsmsg_time >= 5) return;
+    int len = strlen(E.stsmsg);
+    if (len > E.screencols) len = E.screencols;
+    ab_append(ab, E.stsmsg, len);
+}
+
+void refresh_screen () {
+    struct abuf ab = ABUF_INIT;
+    ab_append(&ab, "\x1b[?25l", 6);
+    ab_append(&ab, "\x1b[H", 3);
+    draw_rows(&ab);
+    draw_status_bar(&ab);
+    draw_msg_bar(&ab);
+    ab_append(&ab, "\x1b[H", 3);
+    ab_append(&ab, "\x1b[?25h", 6);
+    write(STDOUT_FILENO, ab.b, ab.len);
+    ab_free(&ab);
+}
+/* }}} */
+/* -- Input -- {{{ */
+int read_key () {
+    int n;
+    char c;
+    while ((n = read(STDIN_FILENO, &c, 1)) != 1)
+        if (n == -1 && errno != EAGAIN) kill("read");
+    return c;
+}
+
+/* read a ':' command on the message bar and run it */
+void prompt_cmd () {
+    char cmd[64];
+    size_t len = 0;
+    E.mode = MISC;
+    set_cursor_type();
+    while (1) {
+        cmd[len] = '\0';
+        set_sts_msg(":%s", cmd);
+        refresh_screen();
+        int c = read_key();
+        if (c == '\x1b') {
+            set_sts_msg("");
+            break;
+        } else if (c == 127 || c == CTRL_KEY('h')) {
+            if (len > 0) len--;
+        } else if (c == '\r') {
+            set_sts_msg("");
+            if (len && !exec_cmd(cmd)) set_sts_msg("Not an editor command: %s", cmd);
+            break;
+        } else if (!iscntrl(c) && len < sizeof(cmd) - 1) {
+            cmd[len++] = c;
+        }
+    }
+    E.mode = NORMAL;
+    set_cursor_type();
+}
+
+void process_keypress () {
+    int c = read_key();
+    switch (c) {
+        case ':':
+            prompt_cmd();
+            break;
+        case CTRL_KEY('g'):
+            exec_cmd("stats");
+            break;
+        case CTRL_KEY('s'):
+            exec_cmd("w");
+            break;
+        case CTRL_KEY('q'):
+            quit();
+            break;
+        case 'j':
+            if (E.curs.rowoff + 1 < (int)rope_line_count(E.rope_head)) E.curs.rowoff++;
+            break;
+        case 'k':
+            if (E.curs.rowoff > 0) E.curs.rowoff--;
+            break;
+    }
+}
+/* }}} */
 /*  Entry {{{ */
 void init () {
     E.curs.cx = 0;
@@ -307,11 +624,10 @@ int main (int argc, char *argv[]) {
     init();
     if (argc >= 2) open_file(argv[1]);
 
-    /* while (1) { */
-    /*     refresh_screen(); */
-    /*     process_keypress(); */
-    /* } */
-    quit();
+    while (1) {
+        refresh_screen();
+        process_keypress();
+    }
     return 0;
 }
 /*  }}} */